@@ -1,307 +1,2420 @@
 #define _GNU_SOURCE
 #define EPSILON 0.001
 #define MAX_ITER_DEFAULT 400
+#define ALIGNMENT 64
+#define ARENA_INITIAL_CAPACITY 4096
+#define FAST_PATH_DIGITS 15
+#define MAX_THREADS 256
+#define MIN_CHUNK_BYTES (1 << 20)
+#define BINARY_MAGIC "KMEANSB1"
+#define BINARY_ENDIAN_MARK 0x01020304u
+#define DTYPE_FLOAT64 1
+#define DTYPE_FLOAT32 2
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define MAX_FORMATTED_LENGTH 512
+#define FIXED4_LIMIT 1e15
+#define ABANDON_BLOCK 8
+#define MAX_PANEL_WIDTH 16
+#define MAX_PANEL_WIDTH32 32
+#define MAX_TILE_ROWS 8
+#define MAX_TILE_POINTS 512
+#define DEFAULT_L2_BYTES (256 << 10)
+#define GEMM_MIN_DIM 32
+#define GEMM_MIN_K 64
+#define GEMM_NORM_LIMIT 1e300
+#define YINYANG_GROUP_SIZE 10
+#define YINYANG_MAX_GROUPS 64
+#define YINYANG_GROUPING_ITERS 5
+#define KDTREE_LEAF_SIZE 16
+#define MIN_WORKER_POINTS 2048
+#define GZIP_BLOCK_SIZE (1 << 22)
+#define GZIP_INPUT_SIZE (1 << 20)
+#define GZIP_BLOCKS 3
+#define GZIP_WINDOW_BITS (15 + 16)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+#if defined(__has_include)
+#if __has_include(<zlib.h>)
+#define HAVE_ZLIB 1
+#endif
+#endif
+#ifndef HAVE_ZLIB
+#define HAVE_ZLIB 0
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <float.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+#if HAVE_ZLIB
+#define ZLIB_CONST
+#include <dlfcn.h>
+#include <zlib.h>
+#endif
 
 /* ===================== DATA STRUCTURES ===================== */
 
-typedef struct point_coordinates_cell {
-    double data;
-    struct point_coordinates_cell *next;
-} point_coordinates_cell;
-
-typedef struct point_coordinates_list {
-    point_coordinates_cell *head;
-    point_coordinates_cell *tail;
-} point_coordinates_list;
-
-typedef struct points_cell {
-    point_coordinates_list *point;
-    struct points_cell *next;
-} points_cell;
-
-typedef struct points_list {
-    points_cell *head;
-    points_cell *tail;
+/* All points live in one row-major block: point i is data[i*dim .. i*dim+dim-1]. */
+typedef struct point_arena {
+    double *data;
+    float *data32;          /* float32 mode: the points as floats, and data is NULL */
+    size_t capacity;
+    size_t used;
     unsigned int length;
-} points_list;
+    unsigned int dim;
+    void *mapping;          /* set when data points into a mapped binary file */
+    size_t mapping_size;
+} point_arena;
+
+/* Header of the binary dataset format; the row-major payload follows at offset sizeof(binary_header). */
+typedef struct {
+    char magic[8];
+    uint32_t endian;        /* BINARY_ENDIAN_MARK in the writer's byte order */
+    uint32_t dtype;
+    uint64_t n;
+    uint32_t dim;
+    uint32_t reserved[9];   /* pads the header to 64 bytes so the payload stays aligned */
+} binary_header;
 
 typedef struct {
     double *coords;
 } centroid;
 
-/* ===================== LINKED LIST HELPERS ===================== */
+/* ===================== POINT ARENA ===================== */
 
-point_coordinates_list *create_point_coordinates_list() {
-    point_coordinates_list *list = malloc(sizeof(point_coordinates_list));
-    if (!list) return NULL;
-    list->head = list->tail = NULL;
-    return list;
+void *allocate_aligned(size_t bytes) {
+    void *block;
+    if (posix_memalign(&block, ALIGNMENT, bytes) != 0) return NULL;
+    return block;
 }
 
-int add_coordinate(point_coordinates_list *list, double value) {
-    point_coordinates_cell *cell = malloc(sizeof(point_coordinates_cell));
-    if (!cell) return 0;
-    cell->data = value;
-    cell->next = NULL;
-    if (!list->head) list->head = list->tail = cell;
-    else { list->tail->next = cell; list->tail = cell; }
-    return 1;
+double *allocate_aligned_doubles(size_t count) {
+    return allocate_aligned(count * sizeof(double));
+}
+
+/* A float32 arena stores every coordinate as a float as it is parsed, so no double copy is ever built. */
+point_arena *create_point_arena(int float32) {
+    point_arena *arena = malloc(sizeof(point_arena));
+    if (!arena) return NULL;
+    arena->data = NULL;
+    arena->data32 = NULL;
+    if (float32) arena->data32 = allocate_aligned(ARENA_INITIAL_CAPACITY * sizeof(float));
+    else arena->data = allocate_aligned_doubles(ARENA_INITIAL_CAPACITY);
+    if (!arena->data && !arena->data32) { free(arena); return NULL; }
+    arena->capacity = ARENA_INITIAL_CAPACITY;
+    arena->used = 0;
+    arena->length = 0;
+    arena->dim = 0;
+    arena->mapping = NULL;
+    arena->mapping_size = 0;
+    return arena;
+}
+
+size_t arena_element_size(const point_arena *arena) {
+    return arena->data32 ? sizeof(float) : sizeof(double);
+}
+
+void *arena_payload(const point_arena *arena) {
+    return arena->data32 ? (void *)arena->data32 : (void *)arena->data;
 }
 
-points_cell *create_points_cell(point_coordinates_list *point) {
-    points_cell *cell = malloc(sizeof(points_cell));
-    if (!cell) return NULL;
-    cell->point = point;
-    cell->next = NULL;
-    return cell;
+/* Points the arena at a new payload of its own element type. */
+void set_arena_payload(point_arena *arena, void *payload) {
+    if (arena->data32) arena->data32 = payload;
+    else arena->data = payload;
 }
 
-int add_point(points_list *plist, point_coordinates_list *point) {
-    points_cell *cell = create_points_cell(point);
-    if (!cell) return 0;
-    if (!plist->head) plist->head = plist->tail = cell;
-    else { plist->tail->next = cell; plist->tail = cell; }
-    plist->length++;
+int grow_point_arena(point_arena *arena) {
+    size_t new_capacity = arena->capacity * 2, element_size = arena_element_size(arena);
+    void *data = allocate_aligned(new_capacity * element_size);
+    if (!data) return 0;
+    memcpy(data, arena_payload(arena), arena->used * element_size);
+    free(arena_payload(arena));
+    set_arena_payload(arena, data);
+    arena->capacity = new_capacity;
     return 1;
 }
 
-points_list *create_points_list() {
-    points_list *plist = malloc(sizeof(points_list));
-    if (!plist) return NULL;
-    plist->head = plist->tail = NULL;
-    plist->length = 0;
-    return plist;
+/* A float32 arena narrows the parsed double, exactly as converting the finished double arena would. */
+int add_coordinate(point_arena *arena, double value) {
+    if (arena->used == arena->capacity && !grow_point_arena(arena)) return 0;
+    if (arena->data32) arena->data32[arena->used++] = (float)value;
+    else arena->data[arena->used++] = value;
+    return 1;
 }
 
-void free_point_coordinates_list(point_coordinates_list *list) {
-    point_coordinates_cell *c, *next;
-    if (!list) return;
-    c = list->head;
-    while (c) {
-        next = c->next;
-        free(c);
-        c = next;
-    }
-    free(list);
+/* Closes the row started at row_start; the first row fixes the dimension of the arena. */
+int commit_point(point_arena *arena, size_t row_start) {
+    unsigned int dim_count = (unsigned int)(arena->used - row_start);
+    if (arena->length == 0) arena->dim = dim_count;
+    else if (dim_count != arena->dim) { arena->used = row_start; return 0; }
+    arena->length++;
+    return 1;
 }
 
-void free_points_list(points_list *plist) {
-    points_cell *p, *next_p;
-    if (!plist) return;
-    p = plist->head;
-    while (p) {
-        free_point_coordinates_list(p->point);
-        next_p = p->next;
-        free(p);
-        p = next_p;
+void free_point_arena(point_arena *arena) {
+    if (!arena) return;
+    if (arena->mapping) munmap(arena->mapping, arena->mapping_size);
+    else { free(arena->data); free(arena->data32); }
+    free(arena);
+}
+
+/* ===================== NUMBER PARSING ===================== */
+
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * Locale-free replacement for sscanf("%lf"). A plain decimal with at most
+ * FAST_PATH_DIGITS significant digits and a power of ten up to 1e22 is one
+ * exact integer scaled by one exact power of ten, so a single multiply or
+ * divide rounds it exactly like strtod (Clinger's fast path). Anything else
+ * (long mantissas, large exponents, hex, inf, nan, leading whitespace) is
+ * handed to strtod itself. Returns the end of the number, or NULL if none.
+ */
+const char *parse_double(const char *str, double *value) {
+    const char *p = str, *digits_start, *exp_start;
+    double mantissa = 0, result;
+    int negative = 0, exact = 1, digits = 0, significant = 0, exponent = 0, exp_value = 0, exp_negative = 0;
+    char *end;
+
+    if (*p == '-' || *p == '+') { negative = (*p == '-'); p++; }
+    digits_start = p;
+    for (; *p >= '0' && *p <= '9'; p++, digits++) {
+        if (mantissa == 0 && *p == '0') continue;
+        if (significant == FAST_PATH_DIGITS) { exact = 0; continue; }
+        mantissa = mantissa * 10 + (*p - '0');
+        significant++;
+    }
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++, digits++) {
+            if (mantissa == 0 && *p == '0') { exponent--; continue; }
+            if (significant == FAST_PATH_DIGITS) { exact = 0; continue; }
+            mantissa = mantissa * 10 + (*p - '0');
+            significant++;
+            exponent--;
+        }
+    }
+    if (digits == 0) exact = 0;
+    if (p == digits_start + 1 && *digits_start == '0' && (*p == 'x' || *p == 'X')) exact = 0;
+    if (exact && (*p == 'e' || *p == 'E')) {
+        exp_start = p++;
+        if (*p == '-' || *p == '+') { exp_negative = (*p == '-'); p++; }
+        if (*p < '0' || *p > '9') p = exp_start;
+        for (; *p >= '0' && *p <= '9'; p++) if (exp_value < 10000) exp_value = exp_value * 10 + (*p - '0');
+        exponent += exp_negative ? -exp_value : exp_value;
     }
-    free(plist);
+    if (exact && exponent >= -22 && exponent <= 22) {
+        result = exponent < 0 ? mantissa / powers_of_ten[-exponent] : mantissa * powers_of_ten[exponent];
+        *value = negative ? -result : result;
+        return p;
+    }
+    *value = strtod(str, &end);
+    return end == str ? NULL : end;
 }
 
 /* ===================== INPUT READING ===================== */
 
-point_coordinates_list *parse_line(const char *line, unsigned int expected_dim) {
-    const char *ptr = line;
-    unsigned int dim_count = 0;
-    int n;
+/* Parses the point in [line, line_end); *line_end is the newline or NUL that ends the line. */
+int parse_line(const char *line, const char *line_end, point_arena *arena) {
+    const char *ptr = line, *end;
+    size_t row_start = arena->used;
     double value;
-    point_coordinates_list *coords = create_point_coordinates_list();
-    if (!coords) return NULL;
-    while (*ptr) {
-        if (sscanf(ptr, "%lf%n", &value, &n) != 1) { free_point_coordinates_list(coords); return NULL; }
-        if (!add_coordinate(coords, value)) { free_point_coordinates_list(coords); return NULL; }
-        ptr += n;
-        dim_count++;
+    while (ptr < line_end) {
+        while (*ptr == ' ' || *ptr == '\t') { ptr++; }
+        end = ptr < line_end ? parse_double(ptr, &value) : NULL;
+        if (!end || end > line_end) { arena->used = row_start; return 0; }
+        if (!add_coordinate(arena, value)) { arena->used = row_start; return 0; }
+        ptr = end;
         while (*ptr == ' ' || *ptr == '\t') { ptr++; }
         if (*ptr == ',') ptr++;
-        else if (*ptr != '\0') { free_point_coordinates_list(coords); return NULL; }
+        else if (ptr != line_end) { arena->used = row_start; return 0; }
+    }
+    return commit_point(arena, row_start);
+}
+
+/* Parses every line of buf in place. Only a last line without a newline is copied, to give the parser a terminator. */
+int parse_buffer(const char *buf, size_t size, point_arena *arena) {
+    const char *line = buf, *limit = buf + size, *newline;
+    char *tail;
+    int ok;
+    while (line < limit) {
+        newline = memchr(line, '\n', limit - line);
+        if (!newline) break;
+        if (newline > line && !parse_line(line, newline, arena)) return 0;
+        line = newline + 1;
+    }
+    if (line == limit) return 1;
+    tail = malloc(limit - line + 1);
+    if (!tail) return 0;
+    memcpy(tail, line, limit - line);
+    tail[limit - line] = '\0';
+    ok = parse_line(tail, tail + (limit - line), arena);
+    free(tail);
+    return ok;
+}
+
+/* ===================== PARALLEL INGESTION ===================== */
+
+typedef struct {
+    const char *begin;
+    const char *end;
+    point_arena *arena;
+    int ok;
+} parse_chunk;
+
+/* KMEANS_THREADS overrides the number of online CPUs. */
+unsigned int thread_count() {
+    const char *env = getenv("KMEANS_THREADS");
+    char *end;
+    long n = 0;
+    if (env && *env) { n = strtol(env, &end, 10); if (*end != '\0') n = 0; }
+    if (n < 1) n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    return n > MAX_THREADS ? MAX_THREADS : (unsigned int)n;
+}
+
+void *parse_chunk_worker(void *arg) {
+    parse_chunk *chunk = arg;
+    chunk->ok = parse_buffer(chunk->begin, chunk->end - chunk->begin, chunk->arena);
+    return NULL;
+}
+
+/* Appends the chunk arenas to arena in input order; every non-empty chunk must agree on the dimension. */
+int merge_chunks(point_arena *arena, parse_chunk *chunks, unsigned int count) {
+    size_t total = 0, offset = 0;
+    unsigned int i;
+    for (i = 0; i < count; i++) {
+        if (!chunks[i].ok) return 0;
+        if (chunks[i].arena->length == 0) continue;
+        if (arena->length > 0 && chunks[i].arena->dim != arena->dim) return 0;
+        arena->dim = chunks[i].arena->dim;
+        arena->length += chunks[i].arena->length;
+        total += chunks[i].arena->used;
+    }
+    if (total > arena->capacity) {
+        free(arena_payload(arena));
+        set_arena_payload(arena, allocate_aligned(total * arena_element_size(arena)));
+        if (!arena_payload(arena)) return 0;
+        arena->capacity = total;
+    }
+    for (i = 0; i < count; i++) {
+        memcpy((char *)arena_payload(arena) + offset * arena_element_size(arena), arena_payload(chunks[i].arena),
+               chunks[i].arena->used * arena_element_size(arena));
+        offset += chunks[i].arena->used;
+    }
+    arena->used = total;
+    return 1;
+}
+
+/*
+ * Splits buf into newline-aligned chunks, parses each on its own thread into
+ * a private arena and stitches the results back in input order, so the first
+ * k points are the same as with a sequential parse.
+ */
+int parse_buffer_parallel(const char *buf, size_t size, point_arena *arena) {
+    parse_chunk chunks[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    unsigned int count, started = 0, i;
+    const char *begin = buf, *limit = buf + size, *cut;
+    int ok = 1;
+
+    count = thread_count();
+    if (size / MIN_CHUNK_BYTES < count) count = (unsigned int)(size / MIN_CHUNK_BYTES);
+    if (count <= 1) return parse_buffer(buf, size, arena);
+
+    for (i = 0; i < count && begin < limit; i++) {
+        cut = (i == count - 1) ? limit : buf + size / count * (i + 1);
+        if (cut < begin) cut = begin;
+        if (cut < limit) { cut = memchr(cut, '\n', limit - cut); cut = cut ? cut + 1 : limit; }
+        chunks[i].begin = begin;
+        chunks[i].end = cut;
+        chunks[i].ok = 0;
+        chunks[i].arena = create_point_arena(arena->data32 != NULL);
+        if (!chunks[i].arena) { ok = 0; break; }
+        if (pthread_create(&threads[i], NULL, parse_chunk_worker, &chunks[i]) != 0) { free_point_arena(chunks[i].arena); ok = 0; break; }
+        started++;
+        begin = cut;
+    }
+    for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    if (ok) ok = merge_chunks(arena, chunks, started);
+    for (i = 0; i < started; i++) free_point_arena(chunks[i].arena);
+    return ok;
+}
+
+/* ===================== BINARY FORMAT ===================== */
+
+int is_binary_dataset(const void *map, size_t size) {
+    return size >= sizeof(binary_header) && memcmp(map, BINARY_MAGIC, 8) == 0;
+}
+
+/* Points the arena straight at the mapped payload; the arena owns the mapping from here on. */
+int load_binary_mapping(void *map, size_t size, point_arena *arena) {
+    const binary_header *header = map;
+    size_t element_size = header->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    void *payload = (char *)map + sizeof(binary_header);
+    if (header->endian != BINARY_ENDIAN_MARK) return 0;
+    if (header->dtype != DTYPE_FLOAT64 && header->dtype != DTYPE_FLOAT32) return 0;
+    if (header->dim == 0 || header->n == 0 || header->n > UINT_MAX) return 0;
+    if (header->n * header->dim > (size - sizeof(binary_header)) / element_size) return 0;
+    free(arena_payload(arena));
+    arena->data = NULL;
+    arena->data32 = NULL;
+    if (header->dtype == DTYPE_FLOAT32) arena->data32 = payload;
+    else arena->data = payload;
+    arena->capacity = arena->used = (size_t)(header->n * header->dim);
+    arena->length = (unsigned int)header->n;
+    arena->dim = header->dim;
+    arena->mapping = map;
+    arena->mapping_size = size;
+    madvise(map, size, MADV_WILLNEED);
+    return 1;
+}
+
+int write_binary_dataset(const char *path, const point_arena *arena) {
+    binary_header header;
+    FILE *out;
+    int ok;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_MAGIC, 8);
+    header.endian = BINARY_ENDIAN_MARK;
+    header.dtype = arena->data32 ? DTYPE_FLOAT32 : DTYPE_FLOAT64;
+    header.n = arena->length;
+    header.dim = arena->dim;
+    out = fopen(path, "wb");
+    if (!out) return 0;
+    ok = fwrite(&header, sizeof(header), 1, out) == 1
+        && (arena->data32 ? fwrite(arena->data32, sizeof(float), arena->used, out)
+                          : fwrite(arena->data, sizeof(double), arena->used, out)) == arena->used;
+    if (fclose(out) != 0) ok = 0;
+    return ok;
+}
+
+/* ===================== COMPRESSED INPUT ===================== */
+
+int is_gzip_data(const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    return size >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b;
+}
+
+#if HAVE_ZLIB
+/* zlib is opened at run time, so the build still links with -lm alone. */
+typedef struct {
+    void *handle;
+    int (*inflate_init)(z_streamp, int, const char *, int);
+    int (*inflate)(z_streamp, int);
+    int (*inflate_reset)(z_streamp);
+    int (*inflate_end)(z_streamp);
+} zlib_api;
+
+/* Decompressed text handed from the inflate thread to the parser; length always ends on a line except in the last block. */
+typedef struct {
+    char *data;
+    size_t capacity;
+    size_t length;
+} text_block;
+
+/* A ring of GZIP_BLOCKS blocks: the inflate thread fills block produced % GZIP_BLOCKS while the parser drains block consumed % GZIP_BLOCKS. */
+typedef struct {
+    zlib_api zlib;
+    z_stream stream;
+    const unsigned char *input;     /* mapped compressed input, or NULL when reading from file */
+    size_t input_left;
+    FILE *file;
+    unsigned char *input_buffer;
+    text_block blocks[GZIP_BLOCKS];
+    unsigned long produced;
+    unsigned long consumed;
+    int finished;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} gzip_reader;
+
+int resolve_symbol(void *handle, const char *name, void *target) {
+    void *symbol = dlsym(handle, name);
+    if (symbol) memcpy(target, &symbol, sizeof(symbol));
+    return symbol != NULL;
+}
+
+int load_zlib(zlib_api *zlib) {
+    zlib->handle = dlopen("libz.so.1", RTLD_NOW);
+    if (!zlib->handle) return 0;
+    if (resolve_symbol(zlib->handle, "inflateInit2_", &zlib->inflate_init)
+        && resolve_symbol(zlib->handle, "inflate", &zlib->inflate)
+        && resolve_symbol(zlib->handle, "inflateReset", &zlib->inflate_reset)
+        && resolve_symbol(zlib->handle, "inflateEnd", &zlib->inflate_end)) return 1;
+    dlclose(zlib->handle);
+    return 0;
+}
+
+int reserve_block(text_block *block, size_t size) {
+    char *data;
+    if (size < GZIP_BLOCK_SIZE) size = GZIP_BLOCK_SIZE;
+    if (block->capacity >= size) return 1;
+    data = realloc(block->data, size);
+    if (!data) return 0;
+    block->data = data;
+    block->capacity = size;
+    return 1;
+}
+
+/* Hands inflate the next slice of compressed input; returns 0 once the input is exhausted. */
+int refill_gzip_input(gzip_reader *reader) {
+    size_t n;
+    if (reader->file) {
+        n = fread(reader->input_buffer, 1, GZIP_INPUT_SIZE, reader->file);
+        reader->stream.next_in = reader->input_buffer;
+    } else {
+        n = reader->input_left < GZIP_INPUT_SIZE ? reader->input_left : GZIP_INPUT_SIZE;
+        reader->stream.next_in = reader->input;
+        reader->input += n;
+        reader->input_left -= n;
     }
-    if (expected_dim != 0 && dim_count != expected_dim) { free_point_coordinates_list(coords); return NULL; }
-    return coords;
+    reader->stream.avail_in = (uInt)n;
+    return n > 0;
 }
 
-points_list *read_points(unsigned int *dim) {
-    points_list *plist;
+/* Inflates until the block is full (0) or the input ends (1); corrupt or truncated data gives -1. */
+int inflate_into(gzip_reader *reader, text_block *block) {
+    int rc;
+    while (block->length < block->capacity) {
+        if (reader->stream.avail_in == 0) refill_gzip_input(reader);
+        reader->stream.next_out = (Bytef *)block->data + block->length;
+        reader->stream.avail_out = (uInt)(block->capacity - block->length);
+        rc = reader->zlib.inflate(&reader->stream, Z_NO_FLUSH);
+        block->length = (char *)reader->stream.next_out - block->data;
+        if (rc == Z_STREAM_END) {
+            /* concatenated members, as written by cat a.gz b.gz, decode as one stream */
+            if (reader->stream.avail_in == 0 && !refill_gzip_input(reader)) return 1;
+            if (reader->zlib.inflate_reset(&reader->stream) != Z_OK) return -1;
+        }
+        else if (rc != Z_OK) return -1;     /* Z_BUF_ERROR: the input ended inside a member */
+    }
+    return 0;
+}
+
+/*
+ * Fills the ring one block at a time. A block is cut after its last newline
+ * and the partial line is carried to the front of the next block, so the
+ * parser only ever sees whole lines; a block without any newline is grown.
+ */
+void *gzip_inflate_worker(void *arg) {
+    gzip_reader *reader = arg;
+    text_block *block, *previous = NULL;
+    char *newline = NULL;
+    size_t carry = 0;
+    int status = 0, stop;
+
+    while (status == 0) {
+        pthread_mutex_lock(&reader->lock);
+        while (reader->produced - reader->consumed == GZIP_BLOCKS && !reader->failed) pthread_cond_wait(&reader->changed, &reader->lock);
+        stop = reader->failed;
+        pthread_mutex_unlock(&reader->lock);
+        if (stop) break;
+
+        block = &reader->blocks[reader->produced % GZIP_BLOCKS];
+        if (!reserve_block(block, carry * 2)) status = -1;
+        else {
+            if (carry) memcpy(block->data, previous->data + previous->length, carry);
+            block->length = carry;
+        }
+        while (status == 0) {
+            status = inflate_into(reader, block);
+            if (status != 0) break;
+            newline = memrchr(block->data, '\n', block->length);
+            if (newline) break;
+            if (!reserve_block(block, block->capacity * 2)) status = -1;
+        }
+        if (status == 0) {
+            carry = block->length - (newline + 1 - block->data);
+            block->length -= carry;
+        }
+
+        pthread_mutex_lock(&reader->lock);
+        if (status < 0) reader->failed = 1;
+        else reader->produced++;
+        if (status > 0) reader->finished = 1;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        previous = block;
+    }
+    return NULL;
+}
+
+/* Parses blocks as the inflate thread publishes them, so decompression of the next block overlaps parsing. */
+int parse_gzip_blocks(gzip_reader *reader, point_arena *arena) {
+    text_block *block;
+    int ready, ok = 1;
+    for (;;) {
+        pthread_mutex_lock(&reader->lock);
+        while (reader->consumed == reader->produced && !reader->finished && !reader->failed) pthread_cond_wait(&reader->changed, &reader->lock);
+        ready = reader->consumed < reader->produced && !reader->failed;
+        pthread_mutex_unlock(&reader->lock);
+        if (!ready) break;
+        block = &reader->blocks[reader->consumed % GZIP_BLOCKS];
+        ok = parse_buffer(block->data, block->length, arena);
+        pthread_mutex_lock(&reader->lock);
+        if (ok) reader->consumed++;
+        else reader->failed = 1;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        if (!ok) break;
+    }
+    return ok;
+}
+
+/* Decodes gzip data from memory (file NULL) or from file, streaming the text straight into the parser. */
+int parse_gzip(const void *data, size_t size, FILE *file, point_arena *arena) {
+    gzip_reader reader;
+    pthread_t thread;
+    unsigned int i;
+    int ok = 0;
+
+    memset(&reader, 0, sizeof(reader));
+    if (!load_zlib(&reader.zlib)) return 0;
+    reader.input = data;
+    reader.input_left = size;
+    reader.file = file;
+    if ((!file || (reader.input_buffer = malloc(GZIP_INPUT_SIZE)))
+        && reader.zlib.inflate_init(&reader.stream, GZIP_WINDOW_BITS, ZLIB_VERSION, (int)sizeof(z_stream)) == Z_OK) {
+        pthread_mutex_init(&reader.lock, NULL);
+        pthread_cond_init(&reader.changed, NULL);
+        if (pthread_create(&thread, NULL, gzip_inflate_worker, &reader) == 0) {
+            ok = parse_gzip_blocks(&reader, arena);
+            pthread_join(thread, NULL);
+            ok = ok && !reader.failed;
+        }
+        pthread_cond_destroy(&reader.changed);
+        pthread_mutex_destroy(&reader.lock);
+        reader.zlib.inflate_end(&reader.stream);
+    }
+    for (i = 0; i < GZIP_BLOCKS; i++) free(reader.blocks[i].data);
+    free(reader.input_buffer);
+    dlclose(reader.zlib.handle);
+    return ok;
+}
+#else
+int parse_gzip(const void *data, size_t size, FILE *file, point_arena *arena) {
+    (void)data; (void)size; (void)file; (void)arena;
+    return 0;
+}
+#endif
+
+/* Maps a regular file read-only and parses it straight from the page cache; binary datasets are used in place and gzip data is decompressed as it is parsed. */
+int read_points_from_fd(int fd, point_arena *arena) {
+    struct stat st;
+    void *map;
+    int ok;
+    if (fstat(fd, &st) != 0) return 0;
+    if (st.st_size == 0) return 1;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 0;
+    if (is_binary_dataset(map, st.st_size)) {
+        ok = load_binary_mapping(map, st.st_size, arena);
+        if (!ok) munmap(map, st.st_size);
+        return ok;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    ok = is_gzip_data(map, st.st_size) ? parse_gzip(map, st.st_size, NULL, arena) : parse_buffer_parallel(map, st.st_size, arena);
+    munmap(map, st.st_size);
+    return ok;
+}
+
+/* Pipes, FIFOs and other unmappable inputs are streamed line by line, or block by block when gzip compressed. */
+int read_points_from_stream(FILE *file, point_arena *arena) {
     char *line = NULL;
     size_t len = 0;
     ssize_t nread;
-    *dim = 0;
-
-    plist = create_points_list();
-    if (!plist) return NULL;
-
-    while ((nread = getline(&line, &len, stdin)) != -1) {
-        point_coordinates_list *coords;
+    int first;
+    /* 0x1f cannot start a line of points, so one byte of lookahead is enough to route gzip data to the decoder */
+    first = getc(file);
+    ungetc(first, file);
+    if (first == 0x1f) return parse_gzip(NULL, 0, file, arena);
+    while ((nread = getline(&line, &len, file)) != -1) {
         if (nread == 1 && line[0] == '\n') continue;
-        if (line[nread - 1] == '\n') line[nread - 1] = '\0';
-        coords = parse_line(line, *dim);
-        free(line);
-        line = NULL;
-        if (!coords) { free_points_list(plist); return NULL; }
-        if (plist->length == 0) {
-            point_coordinates_cell *c = coords->head;
-            unsigned int count = 0;
-            while (c) { count++; c = c->next; }
-            *dim = count;
-        }
-        if (!add_point(plist, coords)) { free_point_coordinates_list(coords); free_points_list(plist); return NULL; }
+        if (line[nread - 1] == '\n') line[--nread] = '\0';
+        if (!parse_line(line, line + nread, arena)) { free(line); return 0; }
     }
     free(line);
-    if (plist->length == 0) { free_points_list(plist); return NULL; }
-    return plist;
+    return 1;
 }
 
-/* ===================== MATRIX CONVERSION ===================== */
+/* A regular file is mapped; anything else, such as a FIFO or /dev/stdin, is streamed. */
+int read_points_from_file(const char *path, point_arena *arena) {
+    struct stat st;
+    FILE *file;
+    int fd, ok;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        ok = read_points_from_fd(fd, arena);
+        close(fd);
+        return ok;
+    }
+    file = fdopen(fd, "r");
+    if (!file) { close(fd); return 0; }
+    ok = read_points_from_stream(file, arena);
+    fclose(file);
+    return ok;
+}
 
-double **points_to_matrix(points_list *plist, unsigned int dim) {
-    double **matrix;
-    points_cell *p;
-    unsigned int i, j;
+/* A redirected regular file is mapped like an input path; pipes are streamed. */
+int read_points_from_stdin(point_arena *arena) {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && lseek(STDIN_FILENO, 0, SEEK_CUR) == 0)
+        return read_points_from_fd(STDIN_FILENO, arena);
+    return read_points_from_stream(stdin, arena);
+}
 
-    matrix = malloc(plist->length * sizeof(double*));
-    if (!matrix) return NULL;
-    p = plist->head;
-    i = 0;
-    while (p) {
-        point_coordinates_cell *c;
-        matrix[i] = malloc(dim * sizeof(double));
-        if (!matrix[i]) { for (j = 0; j < i; j++) free(matrix[j]); free(matrix); return NULL; }
-        c = p->point->head;
-        j = 0;
-        while (c) {
-            matrix[i][j++] = c->data;
-            c = c->next;
-        }
-        p = p->next;
-        i++;
+/* ===================== PRECISION ===================== */
+
+/* Replaces the double points with a float copy; a mapped float64 dataset is unmapped afterwards. */
+int convert_to_float32(point_arena *arena) {
+    float *data32;
+    size_t i;
+    if (arena->data32) return 1;
+    data32 = allocate_aligned(arena->used * sizeof(float));
+    if (!data32) return 0;
+    for (i = 0; i < arena->used; i++) data32[i] = (float)arena->data[i];
+    if (arena->mapping) { munmap(arena->mapping, arena->mapping_size); arena->mapping = NULL; }
+    else free(arena->data);
+    arena->data = NULL;
+    arena->data32 = data32;
+    arena->capacity = arena->used;
+    return 1;
+}
+
+/* KMEANS_PRECISION=float32 stores and compares points as floats; float64 is the default. Returns 0 for any other value. */
+int select_precision(int *float32) {
+    const char *precision = getenv("KMEANS_PRECISION");
+    *float32 = 0;
+    if (!precision || strcmp(precision, "float64") == 0) return 1;
+    if (strcmp(precision, "float32") == 0) { *float32 = 1; return 1; }
+    return 0;
+}
+
+/*
+ * Reads from path when given, otherwise from stdin. Text is parsed straight
+ * into floats in float32 mode; only a float64 binary dataset is narrowed
+ * afterwards. A float32 dataset stays float32.
+ */
+point_arena *read_points(const char *path) {
+    point_arena *arena;
+    int ok, float32;
+
+    if (!select_precision(&float32)) return NULL;
+    arena = create_point_arena(float32);
+    if (!arena) return NULL;
+
+    ok = path ? read_points_from_file(path, arena) : read_points_from_stdin(arena);
+    if (ok && float32) ok = convert_to_float32(arena);
+    if (!ok || arena->length == 0) { free_point_arena(arena); return NULL; }
+    return arena;
+}
+
+/* ===================== OUTPUT ===================== */
+
+/* Output is collected here and handed to write() one OUTPUT_BUFFER_SIZE block at a time. */
+typedef struct {
+    int fd;
+    int ok;
+    size_t length;
+    char *data;
+} output_buffer;
+
+output_buffer *open_output(int fd) {
+    output_buffer *out = malloc(sizeof(output_buffer));
+    if (!out) return NULL;
+    out->data = malloc(OUTPUT_BUFFER_SIZE);
+    if (!out->data) { free(out); return NULL; }
+    out->fd = fd;
+    out->ok = 1;
+    out->length = 0;
+    return out;
+}
+
+void flush_output(output_buffer *out) {
+    size_t done = 0;
+    ssize_t written;
+    while (out->ok && done < out->length) {
+        written = write(out->fd, out->data + done, out->length - done);
+        if (written < 0) out->ok = 0;
+        else done += written;
     }
-    return matrix;
+    out->length = 0;
+}
+
+/* Flushes, frees and reports whether every byte was written. */
+int close_output(output_buffer *out) {
+    int ok;
+    flush_output(out);
+    ok = out->ok;
+    free(out->data);
+    free(out);
+    return ok;
 }
 
-void free_matrix(double **matrix, unsigned int n) {
+/* Makes room for at least MAX_FORMATTED_LENGTH more bytes. */
+char *output_cursor(output_buffer *out) {
+    if (OUTPUT_BUFFER_SIZE - out->length < MAX_FORMATTED_LENGTH) flush_output(out);
+    return out->data + out->length;
+}
+
+void output_char(output_buffer *out, char c) {
+    *output_cursor(out) = c;
+    out->length++;
+}
+
+void output_unsigned(output_buffer *out, unsigned int value) {
+    char digits[16], *p = output_cursor(out);
+    int n = 0;
+    do { digits[n++] = (char)('0' + value % 10); value /= 10; } while (value > 0);
+    while (n > 0) *p++ = digits[--n];
+    out->length = p - out->data;
+}
+
+/*
+ * Same bytes as sprintf("%.4f"), including the sign of negative zero and of
+ * negatives that round to zero. The value is scaled by 1e4 and rounded as an
+ * integer; when the scaled value is too close to a rounding tie for the
+ * product's rounding error to be ruled out, or out of integer range, the
+ * value goes through sprintf instead.
+ */
+void output_fixed4(output_buffer *out, double value) {
+    char digits[24], *p = output_cursor(out);
+    int negative = value < 0 || (value == 0 && 1 / value < 0), n = 0;
+    double scaled = (negative ? -value : value) * 10000, whole, fraction;
+    unsigned long units;
+
+    if (!(scaled < FIXED4_LIMIT && scaled < (double)ULONG_MAX)) { out->length += sprintf(p, "%.4f", value); return; }
+    whole = floor(scaled);
+    fraction = scaled - whole;
+    if (fabs(fraction - 0.5) <= scaled * 1e-15) { out->length += sprintf(p, "%.4f", value); return; }
+    units = (unsigned long)whole + (fraction > 0.5);
+
+    if (negative) *p++ = '-';
+    do { digits[n++] = (char)('0' + units % 10); units /= 10; } while (units > 0 || n < 5);
+    while (n > 4) *p++ = digits[--n];
+    *p++ = '.';
+    while (n > 0) *p++ = digits[--n];
+    out->length = p - out->data;
+}
+
+/* KMEANS_LABELS=<path> also writes the cluster of every point, one per line. */
+int write_labels(const char *path, const unsigned int *labels, unsigned int n) {
+    output_buffer *out;
     unsigned int i;
-    if (!matrix) return;
-    for (i = 0; i < n; i++) free(matrix[i]);
-    free(matrix);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return 0;
+    out = open_output(fd);
+    if (!out) { close(fd); return 0; }
+    for (i = 0; i < n; i++) { output_unsigned(out, labels[i]); output_char(out, '\n'); }
+    if (!close_output(out)) { close(fd); return 0; }
+    return close(fd) == 0;
 }
 
 /* ===================== K-MEANS ===================== */
 
-double distance(double *a, double *b, unsigned int dim) {
+/*
+ * Fully unrolled distances for the common small dimensions. They add the
+ * terms in the same order as the generic loop, so results are bit-identical.
+ * The switch on dim is inlined into the callers and always goes the same way
+ * in a run; a pointer chosen at startup measured slower, as the kernels could
+ * then not be inlined.
+ */
+#define DEFINE_SQUARED_DISTANCE(D) \
+    double squared_distance_##D(const double *a, const double *b) { \
+        unsigned int i; \
+        double sum = 0, diff; \
+        _Pragma("GCC unroll 16") \
+        for (i = 0; i < D; i++) { diff = a[i] - b[i]; sum += diff * diff; } \
+        return sum; \
+    }
+
+DEFINE_SQUARED_DISTANCE(2)
+DEFINE_SQUARED_DISTANCE(3)
+DEFINE_SQUARED_DISTANCE(5)
+DEFINE_SQUARED_DISTANCE(8)
+DEFINE_SQUARED_DISTANCE(16)
+
+double squared_distance(const double *a, const double *b, unsigned int dim) {
     unsigned int i;
     double sum = 0, diff;
+    switch (dim) {
+    case 2: return squared_distance_2(a, b);
+    case 3: return squared_distance_3(a, b);
+    case 5: return squared_distance_5(a, b);
+    case 8: return squared_distance_8(a, b);
+    case 16: return squared_distance_16(a, b);
+    }
     for (i = 0; i < dim; i++) { diff = a[i] - b[i]; sum += diff * diff; }
-    return sqrt(sum);
+    return sum;
 }
 
+double distance(const double *a, const double *b, unsigned int dim) {
+    return sqrt(squared_distance(a, b, dim));
+}
+
+/* Row stride of the centroid matrix: rows of at least one cache line are padded to a whole number of
+   lines so each starts 64-byte aligned; shorter rows stay packed so small dimensions don't waste cache. */
+size_t centroid_stride(unsigned int dim) {
+    size_t width = ALIGNMENT / sizeof(double);
+    return dim < width ? dim : (dim + width - 1) / width * width;
+}
+
+/* All k centroids are rows of one 64-byte aligned matrix; a centroid is only a view of its row, and the
+   first centroid's coords own the block. Padding lanes are zeroed and never read by the distance code. */
 centroid *allocate_centroids(unsigned int k, unsigned int dim) {
     centroid *c;
-    unsigned int i, j;
+    double *block;
+    size_t stride = centroid_stride(dim);
+    unsigned int i;
     c = malloc(k * sizeof(centroid));
-    if (!c) return NULL;
-    for (i = 0; i < k; i++) {
-        c[i].coords = malloc(dim * sizeof(double));
-        if (!c[i].coords) { for (j = 0; j < i; j++) free(c[j].coords); free(c); return NULL; }
-    }
+    block = allocate_aligned_doubles((size_t)k * stride);
+    if (!c || !block) { free(c); free(block); return NULL; }
+    memset(block, 0, (size_t)k * stride * sizeof(double));
+    for (i = 0; i < k; i++) c[i].coords = block + (size_t)i * stride;
     return c;
 }
 
-void free_centroids(centroid *c, unsigned int k) {
-    unsigned int i;
+void free_centroids(centroid *c) {
     if (!c) return;
-    for (i = 0; i < k; i++) free(c[i].coords);
+    free(c[0].coords);
     free(c);
 }
 
-void copy_centroids(centroid *dest, centroid *src, unsigned int k, unsigned int dim) {
+/*
+ * The update works on k x dim sums and k counts owned by kmeans(): they are
+ * cleared, every point is added to its cluster's row in index order, and the
+ * means replace the centroids, an empty cluster keeping its own. The lloyd
+ * passes add each point as soon as its label is known, while the row is
+ * still in cache, unless sums is NULL; the other modes and the worker pool
+ * add them after the assignment.
+ */
+void clear_sums(double *sums, unsigned int *counts, unsigned int k, unsigned int dim) {
+    memset(sums, 0, (size_t)k * dim * sizeof(double));
+    memset(counts, 0, k * sizeof(unsigned int));
+}
+
+void add_point(double *sums, unsigned int *counts, const double *point, unsigned int label, unsigned int dim) {
+    double *sum = sums + (size_t)label * dim;
+    unsigned int d;
+    for (d = 0; d < dim; d++) sum[d] += point[d];
+    counts[label]++;
+}
+
+/* Float points, double sums: the means stay as accurate as in float64 mode. */
+void add_point32(double *sums, unsigned int *counts, const float *point, unsigned int label, unsigned int dim) {
+    double *sum = sums + (size_t)label * dim;
+    unsigned int d;
+    for (d = 0; d < dim; d++) sum[d] += point[d];
+    counts[label]++;
+}
+
+/*
+ * Writes the means into next, the buffer not in use this iteration, and
+ * returns the largest change from current; moves, when given, receives each
+ * centroid's own change for the bounded assignment modes. With touched given,
+ * only those clusters are recomputed and the rest are carried over unmoved.
+ */
+double mean_centroids(centroid *next, centroid *current, const double *sums, const unsigned int *counts, const unsigned char *touched,
+                      unsigned int k, unsigned int dim, double *moves) {
+    unsigned int j, d;
+    double max_change = 0, move;
+    for (j = 0; j < k; j++) {
+        if (touched && !touched[j]) { memcpy(next[j].coords, current[j].coords, dim * sizeof(double)); move = 0; }
+        else {
+            if (counts[j] > 0) for (d = 0; d < dim; d++) next[j].coords[d] = sums[(size_t)j * dim + d]/counts[j];
+            else memcpy(next[j].coords, current[j].coords, dim * sizeof(double));
+            move = distance(next[j].coords, current[j].coords, dim);
+        }
+        if (moves) moves[j] = move;
+        if (move > max_change) max_change = move;
+    }
+    return max_change;
+}
+
+/*
+ * The assignment step measures one point against a panel of centroids at a
+ * time. A panel holds width centroids transposed, coordinate d of its centroid
+ * c at panel[d * width + c], so each SIMD lane accumulates one centroid in the
+ * same order as squared_distance() and the sums are bit-identical to the
+ * scalar loop (no FMA, which would round differently). Two vectors per panel
+ * keep two independent add chains in flight. Every ABANDON_BLOCK coordinates
+ * the panel is abandoned once no lane is below limit.
+ */
+typedef void (*panel_kernel)(const double *point, const double *panel, unsigned int dim, double limit, double *out);
+
+/* dots[r * width + c] = rows[r] . centroid c of the panel, for the kernel's tile of rows; FMA tiers only */
+typedef void (*panel_dots_kernel)(const double *const *rows, const double *panel, unsigned int dim, double *dots);
+
+/* The float32 mode's panels: the same layout and order in floats, twice as many lanes per vector. */
+typedef void (*panel_kernel32)(const float *point, const float *panel, unsigned int dim, float limit, float *out);
+
+typedef struct {
+    panel_kernel kernel;
+    panel_dots_kernel dots;
+    panel_kernel32 kernel32;
+    unsigned int width;     /* centroids per panel, at most MAX_PANEL_WIDTH */
+    unsigned int width32;   /* centroids per float panel, at most MAX_PANEL_WIDTH32 */
+    unsigned int rows;      /* points per dots tile, at most MAX_TILE_ROWS */
+    size_t l2_bytes;        /* L2 size the assignment blocks are cut for */
+} distance_kernel;
+
+void panel_distances_scalar(const double *point, const double *panel, unsigned int dim, double limit, double *out) {
+    double sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0, x, diff;
+    unsigned int d = 0, stop;
+    for (;;) {
+        stop = dim - d > ABANDON_BLOCK ? d + ABANDON_BLOCK : dim;
+        for (; d < stop; d++, panel += 4) {
+            x = point[d];
+            diff = x - panel[0]; sum0 += diff * diff;
+            diff = x - panel[1]; sum1 += diff * diff;
+            diff = x - panel[2]; sum2 += diff * diff;
+            diff = x - panel[3]; sum3 += diff * diff;
+        }
+        if (d == dim || (sum0 >= limit && sum1 >= limit && sum2 >= limit && sum3 >= limit)) break;
+    }
+    out[0] = sum0; out[1] = sum1; out[2] = sum2; out[3] = sum3;
+}
+
+void panel_distances32_scalar(const float *point, const float *panel, unsigned int dim, float limit, float *out) {
+    float sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0, x, diff;
+    unsigned int d = 0, stop;
+    for (;;) {
+        stop = dim - d > ABANDON_BLOCK ? d + ABANDON_BLOCK : dim;
+        for (; d < stop; d++, panel += 4) {
+            x = point[d];
+            diff = x - panel[0]; sum0 += diff * diff;
+            diff = x - panel[1]; sum1 += diff * diff;
+            diff = x - panel[2]; sum2 += diff * diff;
+            diff = x - panel[3]; sum3 += diff * diff;
+        }
+        if (d == dim || (sum0 >= limit && sum1 >= limit && sum2 >= limit && sum3 >= limit)) break;
+    }
+    out[0] = sum0; out[1] = sum1; out[2] = sum2; out[3] = sum3;
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("sse2")))
+void panel_distances_sse2(const double *point, const double *panel, unsigned int dim, double limit, double *out) {
+    __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd(), bound = _mm_set1_pd(limit), x, diff0, diff1;
+    unsigned int d = 0, stop;
+    for (;;) {
+        stop = dim - d > ABANDON_BLOCK ? d + ABANDON_BLOCK : dim;
+        for (; d < stop; d++, panel += 4) {
+            x = _mm_set1_pd(point[d]);
+            diff0 = _mm_sub_pd(x, _mm_loadu_pd(panel));
+            diff1 = _mm_sub_pd(x, _mm_loadu_pd(panel + 2));
+            sum0 = _mm_add_pd(sum0, _mm_mul_pd(diff0, diff0));
+            sum1 = _mm_add_pd(sum1, _mm_mul_pd(diff1, diff1));
+        }
+        if (d == dim || _mm_movemask_pd(_mm_or_pd(_mm_cmplt_pd(sum0, bound), _mm_cmplt_pd(sum1, bound))) == 0) break;
+    }
+    _mm_storeu_pd(out, sum0);
+    _mm_storeu_pd(out + 2, sum1);
+}
+
+__attribute__((target("avx2")))
+void panel_distances_avx2(const double *point, const double *panel, unsigned int dim, double limit, double *out) {
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd(), bound = _mm256_set1_pd(limit), x, diff0, diff1;
+    unsigned int d = 0, stop;
+    for (;;) {
+        stop = dim - d > ABANDON_BLOCK ? d + ABANDON_BLOCK : dim;
+        for (; d < stop; d++, panel += 8) {
+            x = _mm256_set1_pd(point[d]);
+            diff0 = _mm256_sub_pd(x, _mm256_loadu_pd(panel));
+            diff1 = _mm256_sub_pd(x, _mm256_loadu_pd(panel + 4));
+            sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(diff0, diff0));
+            sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(diff1, diff1));
+        }
+        if (d == dim || _mm256_movemask_pd(_mm256_or_pd(_mm256_cmp_pd(sum0, bound, _CMP_LT_OQ), _mm256_cmp_pd(sum1, bound, _CMP_LT_OQ))) == 0) break;
+    }
+    _mm256_storeu_pd(out, sum0);
+    _mm256_storeu_pd(out + 4, sum1);
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx2,fma")))
+void panel_dots_avx2(const double *const *rows, const double *panel, unsigned int dim, double *dots) {
+    __m256d acc[4][2], lo, hi, x;
+    unsigned int d, r;
+    for (r = 0; r < 4; r++) acc[r][0] = acc[r][1] = _mm256_setzero_pd();
+    for (d = 0; d < dim; d++, panel += 8) {
+        lo = _mm256_loadu_pd(panel);
+        hi = _mm256_loadu_pd(panel + 4);
+#pragma GCC unroll 4
+        for (r = 0; r < 4; r++) {
+            x = _mm256_set1_pd(rows[r][d]);
+            acc[r][0] = _mm256_fmadd_pd(x, lo, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_pd(x, hi, acc[r][1]);
+        }
+    }
+    for (r = 0; r < 4; r++) { _mm256_storeu_pd(dots + r * 8, acc[r][0]); _mm256_storeu_pd(dots + r * 8 + 4, acc[r][1]); }
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx512f")))
+void panel_distances_avx512(const double *point, const double *panel, unsigned int dim, double limit, double *out) {
+    __m512d sum0 = _mm512_setzero_pd(), sum1 = _mm512_setzero_pd(), bound = _mm512_set1_pd(limit), x, diff0, diff1;
+    unsigned int d = 0, stop;
+    for (;;) {
+        stop = dim - d > ABANDON_BLOCK ? d + ABANDON_BLOCK : dim;
+        for (; d < stop; d++, panel += 16) {
+            x = _mm512_set1_pd(point[d]);
+            diff0 = _mm512_sub_pd(x, _mm512_loadu_pd(panel));
+            diff1 = _mm512_sub_pd(x, _mm512_loadu_pd(panel + 8));
+            sum0 = _mm512_add_pd(sum0, _mm512_mul_pd(diff0, diff0));
+            sum1 = _mm512_add_pd(sum1, _mm512_mul_pd(diff1, diff1));
+        }
+        if (d == dim || (_mm512_cmp_pd_mask(sum0, bound, _CMP_LT_OQ) | _mm512_cmp_pd_mask(sum1, bound, _CMP_LT_OQ)) == 0) break;
+    }
+    _mm512_storeu_pd(out, sum0);
+    _mm512_storeu_pd(out + 8, sum1);
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx512f")))
+void panel_dots_avx512(const double *const *rows, const double *panel, unsigned int dim, double *dots) {
+    __m512d acc[8][2], lo, hi, x;
+    unsigned int d, r;
+    for (r = 0; r < 8; r++) acc[r][0] = acc[r][1] = _mm512_setzero_pd();
+    for (d = 0; d < dim; d++, panel += 16) {
+        lo = _mm512_loadu_pd(panel);
+        hi = _mm512_loadu_pd(panel + 8);
+#pragma GCC unroll 8
+        for (r = 0; r < 8; r++) {
+            x = _mm512_set1_pd(rows[r][d]);
+            acc[r][0] = _mm512_fmadd_pd(x, lo, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_pd(x, hi, acc[r][1]);
+        }
+    }
+    for (r = 0; r < 8; r++) { _mm512_storeu_pd(dots + r * 16, acc[r][0]); _mm512_storeu_pd(dots + r * 16 + 8, acc[r][1]); }
+    _mm256_zeroupper();
+}
+
+__attribute__((target("sse2")))
+void panel_distances32_sse2(const float *point, const float *panel, unsigned int dim, float limit, float *out) {
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps(), bound = _mm_set1_ps(limit), x, diff0, diff1;
+    unsigned int d = 0, stop;
+    for (;;) {
+        stop = dim - d > ABANDON_BLOCK ? d + ABANDON_BLOCK : dim;
+        for (; d < stop; d++, panel += 8) {
+            x = _mm_set1_ps(point[d]);
+            diff0 = _mm_sub_ps(x, _mm_loadu_ps(panel));
+            diff1 = _mm_sub_ps(x, _mm_loadu_ps(panel + 4));
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(diff0, diff0));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(diff1, diff1));
+        }
+        if (d == dim || _mm_movemask_ps(_mm_or_ps(_mm_cmplt_ps(sum0, bound), _mm_cmplt_ps(sum1, bound))) == 0) break;
+    }
+    _mm_storeu_ps(out, sum0);
+    _mm_storeu_ps(out + 4, sum1);
+}
+
+__attribute__((target("avx2")))
+void panel_distances32_avx2(const float *point, const float *panel, unsigned int dim, float limit, float *out) {
+    __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps(), bound = _mm256_set1_ps(limit), x, diff0, diff1;
+    unsigned int d = 0, stop;
+    for (;;) {
+        stop = dim - d > ABANDON_BLOCK ? d + ABANDON_BLOCK : dim;
+        for (; d < stop; d++, panel += 16) {
+            x = _mm256_set1_ps(point[d]);
+            diff0 = _mm256_sub_ps(x, _mm256_loadu_ps(panel));
+            diff1 = _mm256_sub_ps(x, _mm256_loadu_ps(panel + 8));
+            sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(diff0, diff0));
+            sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(diff1, diff1));
+        }
+        if (d == dim || _mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(sum0, bound, _CMP_LT_OQ), _mm256_cmp_ps(sum1, bound, _CMP_LT_OQ))) == 0) break;
+    }
+    _mm256_storeu_ps(out, sum0);
+    _mm256_storeu_ps(out + 8, sum1);
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx512f")))
+void panel_distances32_avx512(const float *point, const float *panel, unsigned int dim, float limit, float *out) {
+    __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps(), bound = _mm512_set1_ps(limit), x, diff0, diff1;
+    unsigned int d = 0, stop;
+    for (;;) {
+        stop = dim - d > ABANDON_BLOCK ? d + ABANDON_BLOCK : dim;
+        for (; d < stop; d++, panel += 32) {
+            x = _mm512_set1_ps(point[d]);
+            diff0 = _mm512_sub_ps(x, _mm512_loadu_ps(panel));
+            diff1 = _mm512_sub_ps(x, _mm512_loadu_ps(panel + 16));
+            sum0 = _mm512_add_ps(sum0, _mm512_mul_ps(diff0, diff0));
+            sum1 = _mm512_add_ps(sum1, _mm512_mul_ps(diff1, diff1));
+        }
+        if (d == dim || (_mm512_cmp_ps_mask(sum0, bound, _CMP_LT_OQ) | _mm512_cmp_ps_mask(sum1, bound, _CMP_LT_OQ)) == 0) break;
+    }
+    _mm512_storeu_ps(out, sum0);
+    _mm512_storeu_ps(out + 16, sum1);
+    _mm256_zeroupper();
+}
+#endif
+
+/* sysconf reports 0 or -1 where the cache size is unknown. */
+size_t cache_size(int name, size_t fallback) {
+    long size = sysconf(name);
+    return size > 0 ? (size_t)size : fallback;
+}
+
+distance_kernel select_distance_kernel() {
+    distance_kernel selected;
+    selected.kernel = panel_distances_scalar;
+    selected.dots = NULL;
+    selected.kernel32 = panel_distances32_scalar;
+    selected.width = 4;
+    selected.width32 = 4;
+    selected.rows = 0;
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+    selected.l2_bytes = cache_size(_SC_LEVEL2_CACHE_SIZE, DEFAULT_L2_BYTES);
+#else
+    selected.l2_bytes = DEFAULT_L2_BYTES;
+#endif
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        selected.kernel = panel_distances_avx512; selected.dots = panel_dots_avx512; selected.width = 16; selected.rows = 8;
+        selected.kernel32 = panel_distances32_avx512; selected.width32 = 32;
+    }
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        selected.kernel = panel_distances_avx2; selected.dots = panel_dots_avx2; selected.width = 8; selected.rows = 4;
+        selected.kernel32 = panel_distances32_avx2; selected.width32 = 16;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        selected.kernel = panel_distances_sse2;
+        selected.kernel32 = panel_distances32_sse2; selected.width32 = 8;
+    }
+#endif
+    return selected;
+}
+
+size_t panel_buffer_size(unsigned int k, unsigned int dim, unsigned int width) {
+    return (size_t)((k + width - 1) / width) * width * dim;
+}
+
+/* Lays the centroids out as width-wide panels; lanes past k stay zero and are never read back. */
+void pack_centroid_panels(double *panels, centroid *centroids, unsigned int k, unsigned int dim, unsigned int width) {
+    unsigned int j, d;
+    memset(panels, 0, panel_buffer_size(k, dim, width) * sizeof(double));
+    for (j = 0; j < k; j++)
+        for (d = 0; d < dim; d++) panels[(size_t)(j / width) * width * dim + (size_t)d * width + j % width] = centroids[j].coords[d];
+}
+
+/* The float32 mode's panels, narrowed from the double centroids. */
+void pack_centroid_panels32(float *panels, centroid *centroids, unsigned int k, unsigned int dim, unsigned int width) {
+    unsigned int j, d;
+    memset(panels, 0, panel_buffer_size(k, dim, width) * sizeof(float));
+    for (j = 0; j < k; j++)
+        for (d = 0; d < dim; d++) panels[(size_t)(j / width) * width * dim + (size_t)d * width + j % width] = (float)centroids[j].coords[d];
+}
+
+/*
+ * Nearest centroid by squared distance. A closer sum only wins if its root is
+ * smaller too, so sums that round to the same distance keep the lower index,
+ * exactly as comparing distance() did.
+ *
+ * When the panels outgrow L2, they are swept in blocks filling half of it,
+ * each against a block of points filling a quarter, so a centroid block is
+ * read from memory once per point block rather than once per point. Every
+ * point carries its best so far from block to block, and the blocks go in
+ * index order, so the labels are those of a single sweep. Once labelled, the
+ * point block is added to the sums while it is still in L2.
+ */
+void assign_labels(const double *points, const double *panels, distance_kernel kernel, unsigned int n, unsigned int k, unsigned int dim, unsigned int *labels,
+                   double *sums, unsigned int *counts) {
+    const double *point;
+    double dists[MAX_PANEL_WIDTH], best_sqs[MAX_TILE_POINTS], best_roots[MAX_TILE_POINTS], best_sq, best_root;
+    unsigned int i, j, lane, count, best, start, rows, first, last, block_rows, block;
+    size_t panel_size = (size_t)kernel.width * dim;
+
+    block = (unsigned int)(kernel.l2_bytes / 2 / (panel_size * sizeof(double))) * kernel.width;
+    if (block < kernel.width) block = kernel.width;
+    block_rows = (unsigned int)(kernel.l2_bytes / 4 / (dim * sizeof(double)));
+    if (block_rows < 1) block_rows = 1;
+    if (block_rows > MAX_TILE_POINTS) block_rows = MAX_TILE_POINTS;
+
+    for (start = 0; start < n; start += rows) {
+        rows = n - start < block_rows ? n - start : block_rows;
+        for (i = 0; i < rows; i++) best_sqs[i] = best_roots[i] = HUGE_VAL;
+        for (first = 0; first < k; first = last) {
+            last = k - first < block ? k : first + block;
+            for (i = 0; i < rows; i++) {
+                point = points + (size_t)(start + i) * dim;
+                best = first == 0 ? 0 : labels[start + i];
+                best_sq = best_sqs[i];
+                best_root = best_roots[i];
+                for (j = first; j < last; j += kernel.width) {
+                    kernel.kernel(point, panels + j / kernel.width * panel_size, dim, best_sq, dists);
+                    count = k - j < kernel.width ? k - j : kernel.width;
+                    for (lane = 0; lane < count; lane++) {
+                        if ((j == 0 && lane == 0) || (dists[lane] < best_sq && sqrt(dists[lane]) < best_root)) {
+                            best_sq = dists[lane];
+                            best_root = sqrt(best_sq);
+                            best = j + lane;
+                        }
+                    }
+                }
+                labels[start + i] = best;
+                best_sqs[i] = best_sq;
+                best_roots[i] = best_root;
+            }
+        }
+        if (sums) for (i = 0; i < rows; i++) add_point(sums, counts, points + (size_t)(start + i) * dim, labels[start + i], dim);
+    }
+}
+
+/*
+ * The float32 sweep: the same blocking over float panels. Squared float
+ * distances are compared directly and the first of equal ones is kept, so the
+ * labels are those of measuring each centroid in turn with float arithmetic.
+ */
+void assign_labels32(const float *points, const float *panels, distance_kernel kernel, unsigned int n, unsigned int k, unsigned int dim,
+                     unsigned int *labels, double *sums, unsigned int *counts) {
+    const float *point;
+    float dists[MAX_PANEL_WIDTH32], best_dists[MAX_TILE_POINTS], best_dist;
+    unsigned int i, j, lane, count, best, start, rows, first, last, block_rows, block;
+    size_t panel_size = (size_t)kernel.width32 * dim;
+
+    block = (unsigned int)(kernel.l2_bytes / 2 / (panel_size * sizeof(float))) * kernel.width32;
+    if (block < kernel.width32) block = kernel.width32;
+    block_rows = (unsigned int)(kernel.l2_bytes / 4 / (dim * sizeof(float)));
+    if (block_rows < 1) block_rows = 1;
+    if (block_rows > MAX_TILE_POINTS) block_rows = MAX_TILE_POINTS;
+
+    for (start = 0; start < n; start += rows) {
+        rows = n - start < block_rows ? n - start : block_rows;
+        for (i = 0; i < rows; i++) best_dists[i] = (float)HUGE_VAL;
+        for (first = 0; first < k; first = last) {
+            last = k - first < block ? k : first + block;
+            for (i = 0; i < rows; i++) {
+                point = points + (size_t)(start + i) * dim;
+                best = first == 0 ? 0 : labels[start + i];
+                best_dist = best_dists[i];
+                for (j = first; j < last; j += kernel.width32) {
+                    kernel.kernel32(point, panels + j / kernel.width32 * panel_size, dim, best_dist, dists);
+                    count = k - j < kernel.width32 ? k - j : kernel.width32;
+                    for (lane = 0; lane < count; lane++)
+                        if ((j == 0 && lane == 0) || dists[lane] < best_dist) { best_dist = dists[lane]; best = j + lane; }
+                }
+                labels[start + i] = best;
+                best_dists[i] = best_dist;
+            }
+        }
+        if (sums) for (i = 0; i < rows; i++) add_point32(sums, counts, points + (size_t)(start + i) * dim, labels[start + i], dim);
+    }
+}
+
+double squared_norm(const double *a, unsigned int dim) {
+    unsigned int i;
+    double sum = 0;
+    for (i = 0; i < dim; i++) sum += a[i] * a[i];
+    return sum;
+}
+
+/*
+ * Batched assignment through ||x||^2 - 2 x.c + ||c||^2. For each block of
+ * points whose expanded distances fill L2, every centroid panel is multiplied
+ * against the block one register tile (rows x width dot products) at a time,
+ * so a panel stays in L1 while the tiles stream past it. Point norms are taken once per run, centroid
+ * norms once per iteration.
+ */
+typedef struct {
+    double *point_norms;
+    double *centroid_norms;     /* padded to whole panels with zeros */
+    double *centroid_slack;     /* slack * centroid_norms[j], the centroid's share of the error bound */
+    double *block;              /* block_rows x padded k expanded distances */
+    double *block_bound;        /* per block row, the smallest expanded distance plus its centroid slack */
+    unsigned int block_rows;
+    double slack;
+    int finite;                 /* every point norm below GEMM_NORM_LIMIT */
+} gemm_workspace;
+
+/* Without FMA the tiles are no faster than the direct panels, so only the AVX2 and AVX-512 tiers take this path. */
+int use_gemm_assignment(distance_kernel kernel, unsigned int k, unsigned int dim) {
+    return kernel.dots && dim >= GEMM_MIN_DIM && k >= GEMM_MIN_K;
+}
+
+void free_gemm_workspace(gemm_workspace *ws) {
+    if (!ws) return;
+    free(ws->point_norms);
+    free(ws->centroid_norms);
+    free(ws->centroid_slack);
+    free(ws->block);
+    free(ws->block_bound);
+    free(ws);
+}
+
+gemm_workspace *create_gemm_workspace(const double *points, unsigned int n, unsigned int k, unsigned int dim, distance_kernel kernel) {
+    gemm_workspace *ws;
+    size_t padded_k = panel_buffer_size(k, 1, kernel.width);
+    unsigned int i;
+    ws = calloc(1, sizeof(gemm_workspace));
+    if (!ws) return NULL;
+    ws->block_rows = (unsigned int)(kernel.l2_bytes / (padded_k * sizeof(double)) / kernel.rows * kernel.rows);
+    if (ws->block_rows < kernel.rows) ws->block_rows = kernel.rows;
+    ws->point_norms = malloc(n * sizeof(double));
+    ws->centroid_norms = calloc(padded_k, sizeof(double));
+    ws->centroid_slack = calloc(padded_k, sizeof(double));
+    ws->block = allocate_aligned_doubles(ws->block_rows * padded_k);
+    ws->block_bound = malloc(ws->block_rows * sizeof(double));
+    if (!ws->point_norms || !ws->centroid_norms || !ws->centroid_slack || !ws->block || !ws->block_bound) { free_gemm_workspace(ws); return NULL; }
+    /* expanded distances are within slack * (||x||^2 + ||c||^2) of squared_distance() */
+    ws->slack = 4.0 * (dim + 2) * DBL_EPSILON;
+    ws->finite = 1;
+    for (i = 0; i < n; i++) {
+        ws->point_norms[i] = squared_norm(points + (size_t)i * dim, dim);
+        if (!(ws->point_norms[i] < GEMM_NORM_LIMIT)) ws->finite = 0;
+    }
+    return ws;
+}
+
+/* Returns 0 when a norm is too large (or not a number) for the expansion to be bounded; the caller then assigns directly. */
+int prepare_centroid_norms(gemm_workspace *ws, centroid *centroids, unsigned int k, unsigned int dim) {
+    unsigned int j;
+    int finite = ws->finite;
+    for (j = 0; j < k; j++) {
+        ws->centroid_norms[j] = squared_norm(centroids[j].coords, dim);
+        ws->centroid_slack[j] = ws->slack * ws->centroid_norms[j];
+        if (!(ws->centroid_norms[j] < GEMM_NORM_LIMIT)) finite = 0;
+    }
+    return finite;
+}
+
+/*
+ * Picks the label the direct comparison would. Only centroids whose expanded
+ * distance could come within the error bound of the smallest one (bound, the
+ * least expanded distance plus its slack) are measured exactly, in index
+ * order and with the same rule as assign_labels.
+ */
+unsigned int select_label(const double *point, const double *expanded, double bound, double point_slack,
+                          const gemm_workspace *ws, centroid *centroids, unsigned int k, unsigned int dim) {
+    double threshold, d, best_sq = HUGE_VAL, best_root = HUGE_VAL;
+    unsigned int j, best = 0;
+    int first = 1;
+    threshold = bound + 2 * point_slack;
+    threshold += 4 * DBL_EPSILON * fabs(threshold);     /* sums this close can still share a root */
+    for (j = 0; j < k; j++) {
+        if (expanded[j] - ws->centroid_slack[j] > threshold) continue;
+        d = squared_distance(point, centroids[j].coords, dim);
+        if (first || (d < best_sq && sqrt(d) < best_root)) { best_sq = d; best_root = sqrt(d); best = j; first = 0; }
+    }
+    return best;
+}
+
+void assign_labels_gemm(const double *points, const double *panels, distance_kernel kernel, gemm_workspace *ws,
+                        centroid *centroids, unsigned int n, unsigned int k, unsigned int dim, unsigned int *labels,
+                        double *sums, unsigned int *counts) {
+    const double *rows[MAX_TILE_ROWS];
+    double dots[MAX_TILE_ROWS * MAX_PANEL_WIDTH], *out, *bound, norm, value;
+    size_t padded_k = panel_buffer_size(k, 1, kernel.width), panel_size = (size_t)kernel.width * dim;
+    unsigned int start, count, tile, r, c, j, lanes;
+    for (start = 0; start < n; start += count) {
+        count = n - start < ws->block_rows ? n - start : ws->block_rows;
+        for (r = 0; r < count; r++) ws->block_bound[r] = HUGE_VAL;
+        for (j = 0; j < k; j += kernel.width) {
+            lanes = k - j < kernel.width ? k - j : kernel.width;
+            for (tile = 0; tile < count; tile += kernel.rows) {
+                /* a short last tile repeats its final row; those results are not stored */
+                for (r = 0; r < kernel.rows; r++) rows[r] = points + (size_t)(start + (tile + r < count ? tile + r : count - 1)) * dim;
+                kernel.dots(rows, panels + j / kernel.width * panel_size, dim, dots);
+                for (r = 0; r < kernel.rows && tile + r < count; r++) {
+                    out = ws->block + (tile + r) * padded_k + j;
+                    bound = ws->block_bound + tile + r;
+                    norm = ws->point_norms[start + tile + r];
+                    for (c = 0; c < lanes; c++) {
+                        out[c] = value = norm - 2 * dots[r * kernel.width + c] + ws->centroid_norms[j + c];
+                        if (value + ws->centroid_slack[j + c] < *bound) *bound = value + ws->centroid_slack[j + c];
+                    }
+                }
+            }
+        }
+        for (r = 0; r < count; r++) {
+            labels[start + r] = select_label(points + (size_t)(start + r) * dim, ws->block + r * padded_k, ws->block_bound[r],
+                                             ws->slack * ws->point_norms[start + r], ws, centroids, k, dim);
+            if (sums) add_point(sums, counts, points + (size_t)(start + r) * dim, labels[start + r], dim);
+        }
+    }
+}
+
+/*
+ * The update for the modes that assign first. After the first iteration only
+ * the clusters a point left or joined since the last update are summed again:
+ * an untouched cluster has the same members, so the full pass would give it
+ * the same sum in the same order and its centroid is kept as is. The touched
+ * ones are still summed from zero in index order, which keeps the result
+ * bit-identical to the full pass and leaves no drift to correct. previous
+ * holds the labels of the last update and touched is k bytes of scratch.
+ */
+double update_centroids(const double *points, centroid *next, centroid *current, const unsigned int *labels, unsigned int *previous,
+                        unsigned char *touched, unsigned int n, unsigned int k, unsigned int dim, double *sums, unsigned int *counts,
+                        double *moves, int first) {
+    unsigned int i, j, changed = 0;
+    size_t members = 0;
+    if (first) {
+        clear_sums(sums, counts, k, dim);
+        for (i = 0; i < n; i++) add_point(sums, counts, points + (size_t)i * dim, labels[i], dim);
+        memcpy(previous, labels, n * sizeof(unsigned int));
+        return mean_centroids(next, current, sums, counts, NULL, k, dim, moves);
+    }
+    memset(touched, 0, k);
+    for (i = 0; i < n; i++)
+        if (labels[i] != previous[i]) { touched[previous[i]] = 1; touched[labels[i]] = 1; previous[i] = labels[i]; changed = 1; }
+    if (!changed) return mean_centroids(next, current, sums, counts, touched, k, dim, moves);
+    /* last iteration's counts estimate how many points the touched clusters hold; past an eighth of the
+       points the filtered pass mispredicts more than the full one costs, and the full one gives the
+       untouched clusters their same sums anyway */
+    for (j = 0; j < k; j++) if (touched[j]) members += counts[j];
+    if (members > n / 8) {
+        clear_sums(sums, counts, k, dim);
+        for (i = 0; i < n; i++) add_point(sums, counts, points + (size_t)i * dim, labels[i], dim);
+    }
+    else {
+        for (j = 0; j < k; j++)
+            if (touched[j]) { memset(sums + (size_t)j * dim, 0, dim * sizeof(double)); counts[j] = 0; }
+        for (i = 0; i < n; i++)
+            if (touched[labels[i]]) add_point(sums, counts, points + (size_t)i * dim, labels[i], dim);
+    }
+    return mean_centroids(next, current, sums, counts, touched, k, dim, moves);
+}
+
+int print_centroids(centroid *centroids, unsigned int k, unsigned int dim) {
     unsigned int i, j;
-    for (i = 0; i < k; i++) for (j = 0; j < dim; j++) dest[i].coords[j] = src[i].coords[j];
+    output_buffer *out = open_output(STDOUT_FILENO);
+    if (!out) return 0;
+    for (i = 0; i < k; i++) {
+        for (j = 0; j < dim; j++) {
+            output_fixed4(out, centroids[i].coords[j]);
+            if (j < dim - 1) output_char(out, ',');
+        }
+        output_char(out, '\n');
+    }
+    return close_output(out);
 }
 
-void assign_labels(double **points, centroid *centroids, unsigned int n, unsigned int k, unsigned int dim, unsigned int *labels) {
-    unsigned int i, j, best;
-    double best_dist, d;
+/* ===================== BOUNDED ASSIGNMENT ===================== */
+
+/*
+ * KMEANS_ALGO picks how labels are found: lloyd (default) measures every
+ * point against every centroid; elkan keeps triangle-inequality bounds to
+ * every centroid and skips the distances they rule out; hamerly keeps one
+ * bound below for all other centroids, so it needs O(n) memory; yinyang keeps
+ * one bound per group of nearby centroids, which filters whole groups when k
+ * is large; kdtree filters centroids per cell of a tree over the points
+ * (see KD-TREE FILTERING). Each mode returns exactly the labels of lloyd (the
+ * lowest index among the nearest), so the centroids are identical.
+ *
+ * Bounds are kept on the true distances. A computed distance is within a
+ * relative slack of the true one, so bounds are widened by 1 + 4 * slack when
+ * set or moved and a centroid is only skipped once its bound exceeds the
+ * assigned distance by a factor of 1 + 3 * slack, which keeps it strictly
+ * farther even after both distances are rounded.
+ */
+typedef enum { ALGO_LLOYD, ALGO_ELKAN, ALGO_HAMERLY, ALGO_YINYANG, ALGO_KDTREE } kmeans_algorithm;
+
+typedef struct {
+    kmeans_algorithm algo;
+    double slack;
+    double *upper;          /* n: bound above on the distance to the assigned centroid */
+    double *lower;          /* elkan: n x k bounds below on the distance to every centroid, stored plus drift */
+    double *drift;          /* elkan: k, every widened move of the centroid so far */
+    double *second;         /* hamerly, yinyang: n, bound below on the distance to every other centroid */
+    double *half_gaps;      /* elkan: k x k, half the distance between two centroids, bounded below */
+    double *half_nearest;   /* k: half the distance to the nearest other centroid, bounded below */
+    double *moves;          /* k: each centroid's change in the last update */
+    unsigned int groups;    /* yinyang: number of centroid groups, t */
+    unsigned int *group_of; /* yinyang: k, the group of every centroid */
+    unsigned int *members;  /* yinyang: k, centroid indices by group, ascending within one */
+    unsigned int *group_start;  /* yinyang: t + 1, where each group starts in members */
+    double *group_lower;    /* yinyang: n x t bounds below on the distance to every other centroid of a group, stored plus drift */
+    double *group_drift;    /* yinyang: t, every widened largest move within the group so far */
+    double *previous_drift; /* yinyang: t, group_drift before the last update */
+    double *group_centers;  /* yinyang: t x dim, used once to group the initial centroids */
+    double *scratch;        /* yinyang: 2 x t, one point's lowest two values per group */
+} bound_state;
+
+/* Returns 0 for an unknown KMEANS_ALGO. */
+int select_algorithm(kmeans_algorithm *algo) {
+    const char *name = getenv("KMEANS_ALGO");
+    if (!name || strcmp(name, "lloyd") == 0) *algo = ALGO_LLOYD;
+    else if (strcmp(name, "elkan") == 0) *algo = ALGO_ELKAN;
+    else if (strcmp(name, "hamerly") == 0) *algo = ALGO_HAMERLY;
+    else if (strcmp(name, "yinyang") == 0) *algo = ALGO_YINYANG;
+    else if (strcmp(name, "kdtree") == 0) *algo = ALGO_KDTREE;
+    else return 0;
+    return 1;
+}
+
+/* Relative error bound of distance(): the squared sum of dim terms, then a root. */
+double bound_slack(unsigned int dim) {
+    return (dim + 8) * DBL_EPSILON;
+}
+
+void free_bound_state(bound_state *b) {
+    if (!b) return;
+    free(b->upper);
+    free(b->lower);
+    free(b->drift);
+    free(b->second);
+    free(b->half_gaps);
+    free(b->half_nearest);
+    free(b->moves);
+    free(b->group_of);
+    free(b->members);
+    free(b->group_start);
+    free(b->group_lower);
+    free(b->group_drift);
+    free(b->previous_drift);
+    free(b->group_centers);
+    free(b->scratch);
+    free(b);
+}
+
+bound_state *create_bound_state(kmeans_algorithm algo, unsigned int n, unsigned int k, unsigned int dim) {
+    bound_state *b = calloc(1, sizeof(bound_state));
+    if (!b) return NULL;
+    b->algo = algo;
+    b->slack = bound_slack(dim);
+    b->upper = malloc(n * sizeof(double));
+    b->half_nearest = malloc(k * sizeof(double));
+    b->moves = calloc(k, sizeof(double));
+    if (algo == ALGO_ELKAN) {
+        b->lower = malloc((size_t)n * k * sizeof(double));
+        b->drift = calloc(k, sizeof(double));
+        b->half_gaps = malloc((size_t)k * k * sizeof(double));
+    }
+    if (algo == ALGO_HAMERLY || algo == ALGO_YINYANG) b->second = malloc(n * sizeof(double));
+    if (algo == ALGO_YINYANG) {
+        b->groups = (k + YINYANG_GROUP_SIZE - 1) / YINYANG_GROUP_SIZE;
+        if (b->groups > YINYANG_MAX_GROUPS) b->groups = YINYANG_MAX_GROUPS;
+        b->group_of = malloc(k * sizeof(unsigned int));
+        b->members = malloc(k * sizeof(unsigned int));
+        b->group_start = malloc((b->groups + 1) * sizeof(unsigned int));
+        b->group_lower = malloc((size_t)n * b->groups * sizeof(double));
+        b->group_drift = calloc(b->groups, sizeof(double));
+        b->previous_drift = calloc(b->groups, sizeof(double));
+        b->group_centers = malloc((size_t)b->groups * dim * sizeof(double));
+        b->scratch = malloc(2 * b->groups * sizeof(double));
+    }
+    if (!b->upper || !b->half_nearest || !b->moves || (algo == ALGO_ELKAN && (!b->lower || !b->drift || !b->half_gaps))
+        || ((algo == ALGO_HAMERLY || algo == ALGO_YINYANG) && !b->second)
+        || (algo == ALGO_YINYANG && (!b->group_of || !b->members || !b->group_start || !b->group_lower
+                                     || !b->group_drift || !b->previous_drift || !b->group_centers || !b->scratch))) {
+        free_bound_state(b);
+        return NULL;
+    }
+    return b;
+}
+
+/* The lloyd order: a nearer centroid wins, and among equally near ones the lower index. */
+int closer(double d, unsigned int j, double best_d, unsigned int best) {
+    return d < best_d || (d == best_d && j < best);
+}
+
+/* Half of every centroid-centroid distance and the nearest one per centroid, shrunk to stay below the true values. */
+void centroid_half_gaps(const bound_state *b, centroid *centroids, unsigned int k, unsigned int dim, double *half_gaps) {
+    double down = 1 - 4 * b->slack, half;
+    unsigned int a, j;
+    for (a = 0; a < k; a++) b->half_nearest[a] = HUGE_VAL;
+    for (a = 0; a < k; a++) {
+        if (half_gaps) half_gaps[(size_t)a * k + a] = 0;
+        for (j = a + 1; j < k; j++) {
+            half = 0.5 * distance(centroids[a].coords, centroids[j].coords, dim) * down;
+            if (half_gaps) half_gaps[(size_t)a * k + j] = half_gaps[(size_t)j * k + a] = half;
+            if (half < b->half_nearest[a]) b->half_nearest[a] = half;
+            if (half < b->half_nearest[j]) b->half_nearest[j] = half;
+        }
+    }
+}
+
+/*
+ * A lower bound is stored as the bound plus the centroid's drift at that time,
+ * so moving a centroid costs one add instead of one per point. The last term
+ * covers the rounding of the two additions.
+ */
+double lower_bound(double stored, double drift) {
+    return (stored - drift) - 4 * DBL_EPSILON * (stored + drift);
+}
+
+/* Keeps the two lowest values seen; a NaN is never lower. */
+void insert_lowest(double v, double *low1, double *low2) {
+    if (v < *low1) { *low2 = *low1; *low1 = v; }
+    else if (v < *low2) *low2 = v;
+}
+
+/*
+ * Groups the initial centroids for yinyang with a few lloyd iterations over
+ * them, seeded with the first t, as the points themselves are. Groups left
+ * empty are dropped, and members lists each group's centroids in index order.
+ */
+void group_centroids(bound_state *b, centroid *centroids, unsigned int k, unsigned int dim) {
+    double *centers = b->group_centers, *counts = b->scratch, *renumber = b->scratch + b->groups, d, best_d;
+    unsigned int iter, j, g, c, best, t = b->groups, *start = b->group_start;
+
+    for (g = 0; g < t; g++) memcpy(centers + (size_t)g * dim, centroids[g].coords, dim * sizeof(double));
+    for (iter = 0; iter < YINYANG_GROUPING_ITERS; iter++) {
+        for (j = 0; j < k; j++) {
+            best = 0;
+            best_d = HUGE_VAL;
+            for (g = 0; g < t; g++) {
+                d = squared_distance(centroids[j].coords, centers + (size_t)g * dim, dim);
+                if (g == 0 || d < best_d) { best_d = d; best = g; }
+            }
+            b->group_of[j] = best;
+        }
+        for (g = 0; g < t; g++) counts[g] = 0;
+        for (j = 0; j < k; j++) counts[b->group_of[j]]++;
+        for (g = 0; g < t; g++) if (counts[g] > 0) memset(centers + (size_t)g * dim, 0, dim * sizeof(double));
+        for (j = 0; j < k; j++)
+            for (c = 0; c < dim; c++) centers[(size_t)b->group_of[j] * dim + c] += centroids[j].coords[c];
+        for (g = 0; g < t; g++)
+            if (counts[g] > 0) for (c = 0; c < dim; c++) centers[(size_t)g * dim + c] /= counts[g];
+    }
+
+    /* renumber the non-empty groups in order, then lay the members out by group */
+    for (g = 0; g < t; g++) counts[g] = 0;
+    for (j = 0; j < k; j++) counts[b->group_of[j]]++;
+    for (g = 0, c = 0; g < t; g++) if (counts[g] > 0) { counts[c] = counts[g]; renumber[g] = c++; }
+    b->groups = c;
+    for (j = 0; j < k; j++) b->group_of[j] = (unsigned int)renumber[b->group_of[j]];
+    start[0] = start[1] = 0;
+    for (g = 1; g < b->groups; g++) start[g + 1] = start[g] + (unsigned int)counts[g - 1];
+    for (j = 0; j < k; j++) b->members[start[b->group_of[j] + 1]++] = j;
+}
+
+/* First iteration (or after a non-finite move): every distance is measured and seeds the bounds. */
+void assign_full(const double *points, centroid *centroids, bound_state *b, unsigned int n, unsigned int k, unsigned int dim, unsigned int *labels) {
+    double up = 1 + 4 * b->slack, down = 1 - 4 * b->slack, d, best_d, second_d, *lower = NULL;
+    double *low1 = b->scratch, *low2 = b->scratch + b->groups;
+    unsigned int i, j, g, best;
     for (i = 0; i < n; i++) {
+        if (b->lower) lower = b->lower + (size_t)i * k;
+        for (g = 0; g < b->groups; g++) low1[g] = low2[g] = HUGE_VAL;
         best = 0;
-        best_dist = distance(points[i], centroids[0].coords, dim);
-        for (j = 1; j < k; j++) {
-            d = distance(points[i], centroids[j].coords, dim);
-            if (d < best_dist) { best_dist = d; best = j; }
+        best_d = second_d = HUGE_VAL;
+        for (j = 0; j < k; j++) {
+            d = distance(points + (size_t)i * dim, centroids[j].coords, dim);
+            if (lower) lower[j] = d * down + b->drift[j];
+            if (b->groups) insert_lowest(d * down, low1 + b->group_of[j], low2 + b->group_of[j]);
+            if (j == 0 || closer(d, j, best_d, best)) { second_d = best_d; best_d = d; best = j; }
+            else if (d < second_d) second_d = d;
         }
+        for (g = 0; g < b->groups; g++)
+            b->group_lower[(size_t)i * b->groups + g] = (g == b->group_of[best] ? low2[g] : low1[g]) + b->group_drift[g];
+        b->upper[i] = best_d * up;
+        if (b->second) b->second[i] = second_d * down;
         labels[i] = best;
     }
 }
 
-void update_centroids(double **points, centroid *centroids, unsigned int *labels, unsigned int n, unsigned int k, unsigned int dim) {
-    unsigned int i, j, d, count;
-    double *sum;
+/*
+ * Elkan's algorithm: the bounds are first moved by how far the centroids
+ * moved. A point whose upper bound is below half the gap to its assigned
+ * centroid's nearest neighbour keeps its label outright; otherwise only the
+ * centroids that neither their lower bound nor half their gap to the assigned
+ * centroid rule out are measured.
+ */
+void assign_elkan(const double *points, centroid *centroids, bound_state *b, unsigned int n, unsigned int k, unsigned int dim, unsigned int *labels) {
+    double up = 1 + 4 * b->slack, down = 1 - 4 * b->slack, margin = 1 + 3 * b->slack;
+    double limit, d, best_d = 0, *lower;
+    const double *point, *gaps;
+    unsigned int i, j, best;
+    int tight;
+
+    centroid_half_gaps(b, centroids, k, dim, b->half_gaps);
+    for (j = 0; j < k; j++) b->drift[j] += b->moves[j] * up;
+    for (i = 0; i < n; i++) {
+        lower = b->lower + (size_t)i * k;
+        best = labels[i];
+        b->upper[i] = (b->upper[i] + b->moves[best] * up) * up;
+        limit = b->upper[i] * margin;
+        if (limit < b->half_nearest[best]) continue;
+
+        point = points + (size_t)i * dim;
+        tight = 0;
+        for (j = 0; j < k; j++) {
+            gaps = b->half_gaps + (size_t)best * k;
+            if (j == best || limit < gaps[j] || limit < lower_bound(lower[j], b->drift[j])) continue;
+            if (!tight) {
+                best_d = distance(point, centroids[best].coords, dim);
+                lower[best] = best_d * down + b->drift[best];
+                b->upper[i] = best_d * up;
+                limit = b->upper[i] * margin;
+                tight = 1;
+                if (limit < gaps[j] || limit < lower_bound(lower[j], b->drift[j])) continue;
+            }
+            d = distance(point, centroids[j].coords, dim);
+            lower[j] = d * down + b->drift[j];
+            if (closer(d, j, best_d, best)) {
+                best_d = d;
+                best = j;
+                b->upper[i] = d * up;
+                limit = b->upper[i] * margin;
+            }
+        }
+        labels[i] = best;
+    }
+}
+
+/* The largest and second largest centroid moves; returns the centroid that made the largest. */
+unsigned int largest_moves(const bound_state *b, unsigned int k, double *largest, double *runner_up) {
+    unsigned int j, farthest = 0;
+    *largest = *runner_up = 0;
     for (j = 0; j < k; j++) {
-        sum = calloc(dim, sizeof(double));
-        if (!sum) return;
-        count = 0;
-        for (i = 0; i < n; i++) {
-            if (labels[i] == j) {
-                for (d = 0; d < dim; d++) sum[d] += points[i][d];
-                count++;
+        if (b->moves[j] > *largest) { *runner_up = *largest; *largest = b->moves[j]; farthest = j; }
+        else if (b->moves[j] > *runner_up) *runner_up = b->moves[j];
+    }
+    return farthest;
+}
+
+/*
+ * Hamerly's algorithm: one bound below covers all other centroids and drops
+ * by the largest move among them. A point keeps its label when its upper
+ * bound is below both that bound and half the gap to its centroid's nearest
+ * neighbour; otherwise, after tightening the upper bound, it is measured
+ * against every centroid and both bounds are reset.
+ */
+void assign_hamerly(const double *points, centroid *centroids, bound_state *b, unsigned int n, unsigned int k, unsigned int dim, unsigned int *labels) {
+    double up = 1 + 4 * b->slack, down = 1 - 4 * b->slack, margin = 1 + 3 * b->slack;
+    double largest, runner_up, limit, d, best_d, second_d, assigned_d;
+    const double *point;
+    unsigned int i, j, best, farthest;
+
+    centroid_half_gaps(b, centroids, k, dim, NULL);
+    farthest = largest_moves(b, k, &largest, &runner_up);
+    for (i = 0; i < n; i++) {
+        best = labels[i];
+        b->upper[i] = (b->upper[i] + b->moves[best] * up) * up;
+        b->second[i] = lower_bound(b->second[i], (best == farthest ? runner_up : largest) * up);
+        limit = b->upper[i] * margin;
+        if (limit < b->half_nearest[best] || limit < b->second[i]) continue;
+
+        point = points + (size_t)i * dim;
+        assigned_d = distance(point, centroids[best].coords, dim);
+        b->upper[i] = assigned_d * up;
+        limit = b->upper[i] * margin;
+        if (limit < b->half_nearest[best] || limit < b->second[i]) continue;
+
+        best_d = second_d = HUGE_VAL;
+        for (j = 0; j < k; j++) {
+            d = j == labels[i] ? assigned_d : distance(point, centroids[j].coords, dim);
+            if (j == 0 || closer(d, j, best_d, best)) { second_d = best_d; best_d = d; best = j; }
+            else if (d < second_d) second_d = d;
+        }
+        b->upper[i] = best_d * up;
+        b->second[i] = second_d * down;
+        labels[i] = best;
+    }
+}
+
+/*
+ * Yinyang k-means: the global bound works as hamerly's, without the gap test.
+ * A point that passes it is checked group by group, each group's bound having
+ * dropped by its largest move; only the groups it does not rule out are
+ * scanned. Inside one, a centroid is also skipped when the group's previous
+ * bound less that centroid's own move rules it out. Scanned groups get a new
+ * bound from the lowest values seen, leaving out the assigned centroid.
+ */
+void assign_yinyang(const double *points, centroid *centroids, bound_state *b, unsigned int n, unsigned int k, unsigned int dim, unsigned int *labels) {
+    double up = 1 + 4 * b->slack, down = 1 - 4 * b->slack, margin = 1 + 3 * b->slack;
+    double largest, runner_up, limit, d, best_d, assigned_d, bound, second, *lower;
+    double *low1 = b->scratch, *low2 = b->scratch + b->groups;
+    const double *point;
+    unsigned int i, j, g, m, best, assigned, farthest, t = b->groups;
+
+    farthest = largest_moves(b, k, &largest, &runner_up);
+    for (g = 0; g < t; g++) {
+        b->previous_drift[g] = b->group_drift[g];
+        for (d = 0, m = b->group_start[g]; m < b->group_start[g + 1]; m++)
+            if (b->moves[b->members[m]] > d) d = b->moves[b->members[m]];
+        b->group_drift[g] += d * up;
+    }
+    for (i = 0; i < n; i++) {
+        assigned = best = labels[i];
+        b->upper[i] = (b->upper[i] + b->moves[best] * up) * up;
+        b->second[i] = lower_bound(b->second[i], (best == farthest ? runner_up : largest) * up);
+        limit = b->upper[i] * margin;
+        if (limit < b->second[i]) continue;
+
+        point = points + (size_t)i * dim;
+        best_d = assigned_d = distance(point, centroids[best].coords, dim);
+        b->upper[i] = best_d * up;
+        limit = b->upper[i] * margin;
+        if (limit < b->second[i]) continue;
+
+        lower = b->group_lower + (size_t)i * t;
+        for (g = 0; g < t; g++) {
+            bound = lower_bound(lower[g], b->group_drift[g]);
+            if (limit < bound) { low1[g] = bound; low2[g] = -1; continue; }
+            low1[g] = low2[g] = HUGE_VAL;
+            for (m = b->group_start[g]; m < b->group_start[g + 1]; m++) {
+                j = b->members[m];
+                if (j == assigned) { insert_lowest(assigned_d * down, low1 + g, low2 + g); continue; }
+                bound = lower_bound(lower[g], b->previous_drift[g] + b->moves[j] * up);
+                if (limit < bound) { insert_lowest(bound, low1 + g, low2 + g); continue; }
+                d = distance(point, centroids[j].coords, dim);
+                insert_lowest(d * down, low1 + g, low2 + g);
+                if (closer(d, j, best_d, best)) {
+                    best_d = d;
+                    best = j;
+                    limit = best_d * up * margin;
+                }
+            }
+        }
+
+        /* unscanned groups keep their bound, but the one left behind must now cover the old centroid */
+        second = HUGE_VAL;
+        for (g = 0; g < t; g++) {
+            if (low2[g] >= 0) {
+                bound = g == b->group_of[best] ? low2[g] : low1[g];
+                lower[g] = bound + b->group_drift[g];
+            }
+            else {
+                bound = low1[g];
+                if (best != assigned && g == b->group_of[assigned] && assigned_d * down < bound) {
+                    bound = assigned_d * down;
+                    lower[g] = bound + b->group_drift[g];
+                }
             }
+            if (bound < second) second = bound;
         }
-        if (count > 0) for (d = 0; d < dim; d++) centroids[j].coords[d] = sum[d]/count;
-        free(sum);
+        b->upper[i] = best_d * up;
+        b->second[i] = second;
+        labels[i] = best;
     }
 }
 
-double max_centroid_change(centroid *c1, centroid *c2, unsigned int k, unsigned int dim) {
+/* A centroid that stopped being finite breaks the bounds; such iterations measure everything, as lloyd does. */
+int moves_are_finite(const bound_state *b, unsigned int k) {
+    unsigned int j;
+    for (j = 0; j < k; j++) if (!(b->moves[j] < HUGE_VAL)) return 0;
+    return 1;
+}
+
+void assign_with_bounds(const double *points, centroid *centroids, bound_state *b, unsigned int n, unsigned int k, unsigned int dim, unsigned int *labels, int first) {
+    if (first && b->algo == ALGO_YINYANG) group_centroids(b, centroids, k, dim);
+    if (first || !moves_are_finite(b, k)) assign_full(points, centroids, b, n, k, dim, labels);
+    else if (b->algo == ALGO_ELKAN) assign_elkan(points, centroids, b, n, k, dim, labels);
+    else if (b->algo == ALGO_HAMERLY) assign_hamerly(points, centroids, b, n, k, dim, labels);
+    else assign_yinyang(points, centroids, b, n, k, dim, labels);
+}
+
+/* ===================== KD-TREE FILTERING ===================== */
+
+/*
+ * Kanungo et al.'s filtering algorithm. The points are put in a kd-tree once,
+ * each node holding the bounding box of its points. Going down the tree, a
+ * centroid is dropped from a cell's candidates once every point of the box is
+ * provably nearer the candidate closest to the box's midpoint; a cell left
+ * with one candidate gets it as the label of all its points, and leaves scan
+ * the remaining candidates in index order. The update still walks the points:
+ * summing whole subtrees would reorder the additions and move the centroids
+ * away from lloyd's.
+ */
+typedef struct {
+    unsigned int begin, end;    /* the node's points in order */
+    unsigned int left, right;   /* child nodes, 0 for a leaf */
+} kd_node;
+
+typedef struct {
+    unsigned int *order;        /* n: point indices, every node's points contiguous */
+    kd_node *nodes;
+    double *boxes;              /* per node: the low corner, then the high corner */
+    unsigned int count;         /* nodes in use */
+    unsigned int depth;         /* levels below the root */
+    unsigned int *candidates;   /* (depth + 1) x k: the candidate list at every level */
+    double slack;
+} kd_tree;
+
+/* Nodes and levels below a node of size points, splitting at the median until a node fits in a leaf. */
+unsigned int kd_node_count(unsigned int size, unsigned int *depth) {
+    unsigned int left_depth = 0, right_depth = 0, count;
+    *depth = 0;
+    if (size <= KDTREE_LEAF_SIZE) return 1;
+    count = 1 + kd_node_count(size / 2, &left_depth) + kd_node_count(size - size / 2, &right_depth);
+    *depth = 1 + (left_depth > right_depth ? left_depth : right_depth);
+    return count;
+}
+
+/* Partially sorts order[begin, end) on coordinate c so that order[mid] is in its sorted place (Hoare's select). */
+void select_median(const double *points, unsigned int dim, unsigned int c, unsigned int *order, unsigned int begin, unsigned int end, unsigned int mid) {
+    long lo = begin, hi = (long)end - 1, i, j;
+    unsigned int swap;
+    double pivot;
+    while (lo < hi) {
+        pivot = points[(size_t)order[lo + (hi - lo) / 2] * dim + c];
+        i = lo;
+        j = hi;
+        while (i <= j) {
+            while (points[(size_t)order[i] * dim + c] < pivot) i++;
+            while (points[(size_t)order[j] * dim + c] > pivot) j--;
+            if (i <= j) { swap = order[i]; order[i] = order[j]; order[j] = swap; i++; j--; }
+        }
+        if ((long)mid <= j) hi = j;
+        else if ((long)mid >= i) lo = i;
+        else break;
+    }
+}
+
+/* The box of a node's points. A coordinate that is not a number widens the box to infinity, which keeps every candidate. */
+void kd_box(const double *points, unsigned int dim, const unsigned int *order, unsigned int begin, unsigned int end, double *box) {
+    double *low = box, *high = box + dim, x;
+    unsigned int p, c;
+    for (c = 0; c < dim; c++) { low[c] = HUGE_VAL; high[c] = -HUGE_VAL; }
+    for (p = begin; p < end; p++)
+        for (c = 0; c < dim; c++) {
+            x = points[(size_t)order[p] * dim + c];
+            if (x != x) { low[c] = -HUGE_VAL; high[c] = HUGE_VAL; }
+            if (x < low[c]) low[c] = x;
+            if (x > high[c]) high[c] = x;
+        }
+}
+
+/* Builds the subtree of order[begin, end) at node index node and returns the next free index. */
+unsigned int kd_build(kd_tree *t, const double *points, unsigned int dim, unsigned int node, unsigned int begin, unsigned int end) {
+    double *box = t->boxes + (size_t)node * 2 * dim, widest = -1;
+    unsigned int c, split = 0, mid = begin + (end - begin) / 2, next = node + 1;
+
+    kd_box(points, dim, t->order, begin, end, box);
+    t->nodes[node].begin = begin;
+    t->nodes[node].end = end;
+    t->nodes[node].left = t->nodes[node].right = 0;
+    if (end - begin <= KDTREE_LEAF_SIZE) return next;
+
+    for (c = 0; c < dim; c++) if (box[dim + c] - box[c] > widest) { widest = box[dim + c] - box[c]; split = c; }
+    select_median(points, dim, split, t->order, begin, end, mid);
+    t->nodes[node].left = next;
+    next = kd_build(t, points, dim, next, begin, mid);
+    t->nodes[node].right = next;
+    return kd_build(t, points, dim, next, mid, end);
+}
+
+void free_kd_tree(kd_tree *t) {
+    if (!t) return;
+    free(t->order);
+    free(t->nodes);
+    free(t->boxes);
+    free(t->candidates);
+    free(t);
+}
+
+kd_tree *build_kd_tree(const double *points, unsigned int n, unsigned int k, unsigned int dim) {
+    kd_tree *t = calloc(1, sizeof(kd_tree));
     unsigned int i;
-    double max_change = 0, move;
-    for (i = 0; i < k; i++) {
-        move = distance(c1[i].coords, c2[i].coords, dim);
-        if (move > max_change) max_change = move;
+    if (!t) return NULL;
+    t->count = kd_node_count(n, &t->depth);
+    t->slack = bound_slack(dim);
+    t->order = malloc(n * sizeof(unsigned int));
+    t->nodes = malloc(t->count * sizeof(kd_node));
+    t->boxes = malloc((size_t)t->count * 2 * dim * sizeof(double));
+    t->candidates = malloc((size_t)(t->depth + 1) * k * sizeof(unsigned int));
+    if (!t->order || !t->nodes || !t->boxes || !t->candidates) { free_kd_tree(t); return NULL; }
+    for (i = 0; i < n; i++) t->order[i] = i;
+    kd_build(t, points, dim, 0, 0, n);
+    return t;
+}
+
+/*
+ * Whether every point of the box is nearer to centroid near than to other,
+ * by more than the rounding of the two distances. The difference of the two
+ * squared distances is linear over the box, so its least value is at the
+ * corner lying furthest towards other; each distance is off by at most slack
+ * times its largest value over the box, reached at the opposite corner.
+ */
+int kd_dominates(const double *box, const double *near, double near_far, const double *other, unsigned int dim, double slack) {
+    const double *low = box, *high = box + dim;
+    double to_other = 0, to_near = 0, other_far = 0, corner, a, b;
+    unsigned int c;
+    for (c = 0; c < dim; c++) {
+        corner = other[c] > near[c] ? high[c] : low[c];
+        to_other += (corner - other[c]) * (corner - other[c]);
+        to_near += (corner - near[c]) * (corner - near[c]);
+        a = (low[c] - other[c]) * (low[c] - other[c]);
+        b = (high[c] - other[c]) * (high[c] - other[c]);
+        other_far += a > b ? a : b;
     }
-    return max_change;
+    return to_other - to_near > 4 * slack * (other_far + near_far);
 }
 
-void print_centroids(centroid *centroids, unsigned int k, unsigned int dim) {
-    unsigned int i, j;
-    for (i = 0; i < k; i++) {
-        for (j = 0; j < dim; j++) {
-            printf("%.4f", centroids[i].coords[j]);
-            if (j < dim - 1) printf(",");
+/* The largest squared distance from a point of the box to centroid. */
+double kd_farthest(const double *box, const double *centroid, unsigned int dim) {
+    double sum = 0, a, b;
+    unsigned int c;
+    for (c = 0; c < dim; c++) {
+        a = (box[c] - centroid[c]) * (box[c] - centroid[c]);
+        b = (box[dim + c] - centroid[c]) * (box[dim + c] - centroid[c]);
+        sum += a > b ? a : b;
+    }
+    return sum;
+}
+
+void kd_filter(kd_tree *t, const double *points, centroid *centroids, unsigned int k, unsigned int dim, unsigned int node,
+               const unsigned int *candidates, unsigned int count, unsigned int level, unsigned int *labels) {
+    const kd_node *cell = t->nodes + node;
+    const double *box = t->boxes + (size_t)node * 2 * dim, *point;
+    double d, best_d = HUGE_VAL, middle, near_far;
+    unsigned int *kept = t->candidates + (size_t)level * k, kept_count = 0, near = candidates[0], j, m, c, p, best;
+
+    for (m = 0; m < count; m++) {
+        for (d = 0, c = 0; c < dim; c++) {
+            middle = 0.5 * box[c] + 0.5 * box[dim + c];
+            d += (middle - centroids[candidates[m]].coords[c]) * (middle - centroids[candidates[m]].coords[c]);
         }
-        printf("\n");
+        if (d < best_d) { best_d = d; near = candidates[m]; }
+    }
+    near_far = kd_farthest(box, centroids[near].coords, dim);
+    for (m = 0; m < count; m++)
+        if (candidates[m] == near || !kd_dominates(box, centroids[near].coords, near_far, centroids[candidates[m]].coords, dim, t->slack))
+            kept[kept_count++] = candidates[m];
+
+    if (kept_count == 1) {
+        for (p = cell->begin; p < cell->end; p++) labels[t->order[p]] = near;
+        return;
     }
+    if (!cell->left) {
+        for (p = cell->begin; p < cell->end; p++) {
+            point = points + (size_t)t->order[p] * dim;
+            best = kept[0];
+            best_d = distance(point, centroids[best].coords, dim);
+            for (m = 1; m < kept_count; m++) {
+                j = kept[m];
+                d = distance(point, centroids[j].coords, dim);
+                if (closer(d, j, best_d, best)) { best_d = d; best = j; }
+            }
+            labels[t->order[p]] = best;
+        }
+        return;
+    }
+    kd_filter(t, points, centroids, k, dim, cell->left, kept, kept_count, level + 1, labels);
+    kd_filter(t, points, centroids, k, dim, cell->right, kept, kept_count, level + 1, labels);
 }
 
-int kmeans(double **points, unsigned int n, unsigned int dim, unsigned int k, unsigned int max_iters) {
-    unsigned int i, iter, j;
+void assign_kd_tree(const double *points, centroid *centroids, kd_tree *t, unsigned int k, unsigned int dim, unsigned int *labels) {
+    unsigned int j, *all = t->candidates + (size_t)t->depth * k;
+    /* the root's list borrows the deepest level, which is only written once the root has filtered it */
+    for (j = 0; j < k; j++) all[j] = j;
+    kd_filter(t, points, centroids, k, dim, 0, all, k, 0, labels);
+}
+
+/* ===================== WORKER POOL ===================== */
+
+/*
+ * With more than one thread the lloyd loop runs on a pool created once per
+ * run, the calling thread working as worker 0. Each iteration is two phases
+ * between barriers. First every worker labels its own slice of the points and
+ * counting-sorts the slice's indices by label. Then every worker sums and
+ * averages its own range of clusters, walking each cluster's members slice by
+ * slice. That adds a cluster's points in index order, as the single-threaded
+ * pass does, so the centroids are bit-identical to it for any thread count;
+ * per-worker partial sums would be reduced in a different order.
+ */
+typedef struct lloyd_pool lloyd_pool;
+
+typedef struct {
+    lloyd_pool *pool;
+    unsigned int begin, end;        /* the points this worker labels */
+    unsigned int first, last;       /* the clusters it sums */
+    unsigned int *starts;           /* k + 1 offsets of each label's indices within the slice */
+    unsigned int *cursor;           /* k */
+    gemm_workspace *gemm;           /* over the slice's points, or NULL for the direct path */
+    double change;
+} pool_worker;
+
+struct lloyd_pool {
+    pthread_t threads[MAX_THREADS];
+    pool_worker workers[MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    unsigned int count, waiting;
+    unsigned long generation;
+    int stop;
+    const point_arena *points;
+    unsigned int k, dim;
     unsigned int *labels;
-    centroid *centroids, *old_centroids;
+    unsigned int *members;          /* n point indices, each slice's grouped by label */
+    double *sums;
+    unsigned int *counts;
+    distance_kernel kernel;
+    /* this iteration's inputs, set before the first barrier */
+    centroid *current, *next;
+    const double *panels;
+    const float *panels32;
+};
+
+void pool_wait(lloyd_pool *pool) {
+    unsigned long generation;
+    pthread_mutex_lock(&pool->lock);
+    generation = pool->generation;
+    if (++pool->waiting >= pool->count) { pool->waiting = 0; pool->generation++; pthread_cond_broadcast(&pool->changed); }
+    else while (generation == pool->generation) pthread_cond_wait(&pool->changed, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_assign(pool_worker *w) {
+    lloyd_pool *pool = w->pool;
+    unsigned int i, j, count = w->end - w->begin, k = pool->k, dim = pool->dim, *labels = pool->labels;
+    if (pool->points->data32)
+        assign_labels32(pool->points->data32 + (size_t)w->begin * dim, pool->panels32, pool->kernel, count, k, dim, labels + w->begin, NULL, NULL);
+    else if (w->gemm && prepare_centroid_norms(w->gemm, pool->current, k, dim))
+        assign_labels_gemm(pool->points->data + (size_t)w->begin * dim, pool->panels, pool->kernel, w->gemm, pool->current, count, k, dim,
+                           labels + w->begin, NULL, NULL);
+    else assign_labels(pool->points->data + (size_t)w->begin * dim, pool->panels, pool->kernel, count, k, dim, labels + w->begin, NULL, NULL);
+    memset(w->starts, 0, (k + 1) * sizeof(unsigned int));
+    for (i = w->begin; i < w->end; i++) w->starts[labels[i] + 1]++;
+    for (j = 0; j < k; j++) { w->starts[j + 1] += w->starts[j]; w->cursor[j] = w->starts[j]; }
+    for (i = w->begin; i < w->end; i++) pool->members[w->begin + w->cursor[labels[i]]++] = i;
+}
+
+void pool_update(pool_worker *w) {
+    lloyd_pool *pool = w->pool;
+    const pool_worker *slice;
+    unsigned int j, s, m, dim = pool->dim;
+    for (j = w->first; j < w->last; j++) {
+        memset(pool->sums + (size_t)j * dim, 0, dim * sizeof(double));
+        pool->counts[j] = 0;
+        for (s = 0; s < pool->count; s++) {
+            slice = pool->workers + s;
+            for (m = slice->begin + slice->starts[j]; m < slice->begin + slice->starts[j + 1]; m++) {
+                if (pool->points->data32)
+                    add_point32(pool->sums, pool->counts, pool->points->data32 + (size_t)pool->members[m] * dim, j, dim);
+                else add_point(pool->sums, pool->counts, pool->points->data + (size_t)pool->members[m] * dim, j, dim);
+            }
+        }
+    }
+    w->change = mean_centroids(pool->next + w->first, pool->current + w->first, pool->sums + (size_t)w->first * dim, pool->counts + w->first,
+                               NULL, w->last - w->first, dim, NULL);
+}
+
+void *pool_thread(void *arg) {
+    pool_worker *w = arg;
+    for (;;) {
+        pool_wait(w->pool);
+        if (w->pool->stop) return NULL;
+        pool_assign(w);
+        pool_wait(w->pool);
+        pool_update(w);
+        pool_wait(w->pool);
+    }
+}
+
+/* Stops and joins the started threads; they are parked at the first barrier, which the caller's wait releases. */
+void stop_pool_threads(lloyd_pool *pool, unsigned int started) {
+    unsigned int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pool->count = started + 1;
+    pthread_mutex_unlock(&pool->lock);
+    pool_wait(pool);
+    for (i = 0; i < started; i++) pthread_join(pool->threads[i], NULL);
+}
+
+void free_lloyd_pool(lloyd_pool *pool, int running) {
+    unsigned int i;
+    if (!pool) return;
+    if (running) stop_pool_threads(pool, pool->count - 1);
+    for (i = 0; i < pool->count; i++) {
+        free(pool->workers[i].starts);
+        free(pool->workers[i].cursor);
+        free_gemm_workspace(pool->workers[i].gemm);
+    }
+    free(pool->members);
+    pthread_cond_destroy(&pool->changed);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/* Returns NULL when one thread is all the run can use, or anything fails; the loop then runs single-threaded. */
+lloyd_pool *create_lloyd_pool(const point_arena *points, unsigned int k, unsigned int *labels, double *sums, unsigned int *counts,
+                              distance_kernel kernel) {
+    lloyd_pool *pool;
+    pool_worker *w;
+    unsigned int i, count = thread_count(), n = points->length, dim = points->dim;
+    int gemm = !points->data32 && use_gemm_assignment(kernel, k, dim);
+    if (n / MIN_WORKER_POINTS < count) count = n / MIN_WORKER_POINTS;
+    if (count <= 1) return NULL;
+    pool = calloc(1, sizeof(lloyd_pool));
+    if (!pool) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+    pool->count = count;
+    pool->points = points;
+    pool->k = k;
+    pool->dim = dim;
+    pool->labels = labels;
+    pool->sums = sums;
+    pool->counts = counts;
+    pool->kernel = kernel;
+    pool->members = malloc(n * sizeof(unsigned int));
+    if (!pool->members) { free_lloyd_pool(pool, 0); return NULL; }
+    for (i = 0; i < count; i++) {
+        w = pool->workers + i;
+        w->pool = pool;
+        w->begin = (unsigned int)((size_t)n * i / count);
+        w->end = (unsigned int)((size_t)n * (i + 1) / count);
+        w->first = (unsigned int)((size_t)k * i / count);
+        w->last = (unsigned int)((size_t)k * (i + 1) / count);
+        w->starts = malloc((k + 1) * sizeof(unsigned int));
+        w->cursor = malloc(k * sizeof(unsigned int));
+        if (!w->starts || !w->cursor) { free_lloyd_pool(pool, 0); return NULL; }
+        /* a worker without a workspace takes the direct path */
+        if (gemm) w->gemm = create_gemm_workspace(points->data + (size_t)w->begin * dim, w->end - w->begin, k, dim, kernel);
+    }
+    for (i = 1; i < count; i++) {
+        if (pthread_create(&pool->threads[i - 1], NULL, pool_thread, pool->workers + i) != 0) {
+            stop_pool_threads(pool, i - 1);
+            pool->count = count;
+            free_lloyd_pool(pool, 0);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/* One lloyd iteration on the pool: labels, sums and the means in next; returns the largest centroid change. */
+double run_lloyd_pool(lloyd_pool *pool, centroid *current, centroid *next, const double *panels, const float *panels32) {
+    unsigned int i;
+    double change = 0;
+    pool->current = current;
+    pool->next = next;
+    pool->panels = panels;
+    pool->panels32 = panels32;
+    pool_wait(pool);
+    pool_assign(pool->workers);
+    pool_wait(pool);
+    pool_update(pool->workers);
+    pool_wait(pool);
+    for (i = 0; i < pool->count; i++) if (pool->workers[i].change > change) change = pool->workers[i].change;
+    return change;
+}
+
+/* ===================== K-MEANS LOOP ===================== */
+
+int kmeans(const point_arena *points, unsigned int k, unsigned int max_iters, const char *labels_path) {
+    unsigned int i, iter, j, n = points->length, dim = points->dim;
+    int ok, fused;
+    unsigned int *labels, *counts, *previous = NULL;
+    unsigned char *touched = NULL;
+    float *panels32 = NULL;
+    double *panels = NULL, *sums;
+    distance_kernel kernel = select_distance_kernel();
+    gemm_workspace *gemm = NULL;
+    kmeans_algorithm algo;
+    bound_state *bounds = NULL;
+    kd_tree *tree = NULL;
+    lloyd_pool *pool = NULL;
+    double change;
+    centroid *centroids, *next_centroids, *swap;
 
+    if (!select_algorithm(&algo)) return 0;
+    /* the bounded modes and the kd-tree keep double bounds and boxes, so float32 points take the lloyd loop only */
+    if (points->data32 && algo != ALGO_LLOYD) return 0;
     labels = malloc(n * sizeof(unsigned int));
     if (!labels) return 0;
     centroids = allocate_centroids(k, dim);
-    old_centroids = allocate_centroids(k, dim);
-    if (!centroids || !old_centroids) { free(labels); free_centroids(centroids, k); free_centroids(old_centroids, k); return 0; }
+    next_centroids = allocate_centroids(k, dim);
+    sums = malloc((size_t)k * dim * sizeof(double));
+    counts = malloc(k * sizeof(unsigned int));
+    if (points->data32) panels32 = allocate_aligned(panel_buffer_size(k, dim, kernel.width32) * sizeof(float));
+    else panels = allocate_aligned_doubles(panel_buffer_size(k, dim, kernel.width));
+    if (!centroids || !next_centroids || !sums || !counts || (points->data32 ? !panels32 : !panels)) {
+        free(labels); free(sums); free(counts); free(panels32); free(panels); free_centroids(centroids); free_centroids(next_centroids); return 0;
+    }
+
+    if (algo == ALGO_KDTREE) {
+        tree = build_kd_tree(points->data, n, k, dim);
+        if (!tree) { free(labels); free(sums); free(counts); free(panels32); free(panels); free_centroids(centroids); free_centroids(next_centroids); return 0; }
+    }
+    else if (algo != ALGO_LLOYD) {
+        bounds = create_bound_state(algo, n, k, dim);
+        if (!bounds) { free(labels); free(sums); free(counts); free(panels32); free(panels); free_centroids(centroids); free_centroids(next_centroids); return 0; }
+    }
+    /* the modes that assign first update only the clusters whose members changed */
+    if (bounds || tree) {
+        previous = malloc(n * sizeof(unsigned int));
+        touched = malloc(k);
+        if (!previous || !touched) {
+            free(labels); free(previous); free(touched); free(sums); free(counts); free(panels32); free(panels); free_centroids(centroids);
+            free_centroids(next_centroids); free_bound_state(bounds); free_kd_tree(tree); return 0;
+        }
+    }
+    /* without a pool the loop runs on this thread and without a workspace it takes the direct path,
+       so a failed allocation only costs speed */
+    if (!bounds && !tree) pool = create_lloyd_pool(points, k, labels, sums, counts, kernel);
+    if (!points->data32 && !bounds && !tree && !pool && use_gemm_assignment(kernel, k, dim)) gemm = create_gemm_workspace(points->data, n, k, dim, kernel);
 
     for (i = 0; i < k; i++)
         for (j = 0; j < dim; j++)
-            centroids[i].coords[j] = points[i][j];
+            centroids[i].coords[j] = points->data32 ? points->data32[(size_t)i * dim + j] : points->data[(size_t)i * dim + j];
 
+    /* the lloyd passes add every point to the sums as they label it */
+    fused = !bounds && !tree;
     for (iter = 0; iter < max_iters; iter++) {
-        assign_labels(points, centroids, n, k, dim, labels);
-        copy_centroids(old_centroids, centroids, k, dim);
-        update_centroids(points, centroids, labels, n, k, dim);
-        if (max_centroid_change(centroids, old_centroids, k, dim) < EPSILON) break;
+        if (pool) {
+            if (points->data32) pack_centroid_panels32(panels32, centroids, k, dim, kernel.width32);
+            else pack_centroid_panels(panels, centroids, k, dim, kernel.width);
+            change = run_lloyd_pool(pool, centroids, next_centroids, panels, panels32);
+        }
+        else {
+            if (fused) clear_sums(sums, counts, k, dim);
+            if (points->data32) {
+                pack_centroid_panels32(panels32, centroids, k, dim, kernel.width32);
+                assign_labels32(points->data32, panels32, kernel, n, k, dim, labels, sums, counts);
+            }
+            else if (bounds) assign_with_bounds(points->data, centroids, bounds, n, k, dim, labels, iter == 0);
+            else if (tree) assign_kd_tree(points->data, centroids, tree, k, dim, labels);
+            else {
+                pack_centroid_panels(panels, centroids, k, dim, kernel.width);
+                if (gemm && prepare_centroid_norms(gemm, centroids, k, dim))
+                    assign_labels_gemm(points->data, panels, kernel, gemm, centroids, n, k, dim, labels, sums, counts);
+                else assign_labels(points->data, panels, kernel, n, k, dim, labels, sums, counts);
+            }
+            /* the means go to the other buffer, which then becomes the current one */
+            if (fused) change = mean_centroids(next_centroids, centroids, sums, counts, NULL, k, dim, NULL);
+            else change = update_centroids(points->data, next_centroids, centroids, labels, previous, touched, n, k, dim, sums, counts,
+                                           bounds ? bounds->moves : NULL, iter == 0);
+        }
+        swap = centroids;
+        centroids = next_centroids;
+        next_centroids = swap;
+        if (change < EPSILON) break;
     }
 
-    print_centroids(centroids, k, dim);
+    ok = print_centroids(centroids, k, dim);
+    if (ok && labels_path) ok = write_labels(labels_path, labels, n);
     free(labels);
-    free_centroids(centroids, k);
-    free_centroids(old_centroids, k);
-    return 1;
+    free(previous);
+    free(touched);
+    free(sums);
+    free(counts);
+    free(panels32);
+    free(panels);
+    free_gemm_workspace(gemm);
+    free_bound_state(bounds);
+    free_kd_tree(tree);
+    free_lloyd_pool(pool, 1);
+    free_centroids(centroids);
+    free_centroids(next_centroids);
+    return ok;
 }
 
 /* ===================== MAIN ===================== */
@@ -314,39 +2427,49 @@ int is_positive_integer(const char *str) {
     return 1;
 }
 
+/* kmeans --convert <output_path> [input_path]: writes the text dataset in the binary format. */
+int convert_main(int argc, char *argv[]) {
+    point_arena *points;
+    int ok;
+    if (argc < 3 || argc > 4) { fprintf(stderr,"An Error Has Occurred\n"); return 1; }
+    points = read_points(argc == 4 ? argv[3] : NULL);
+    if (!points) { fprintf(stderr,"An Error Has Occurred\n"); return 1; }
+    ok = write_binary_dataset(argv[2], points);
+    free_point_arena(points);
+    if (!ok) { fprintf(stderr,"An Error Has Occurred\n"); return 1; }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    points_list *points = NULL;
-    double **matrix = NULL;
-    unsigned int dim, k, max_iters;
+    point_arena *points = NULL;
+    const char *input_path = NULL;
+    unsigned int k, max_iters;
 
-    if (argc < 2 || argc > 3) { fprintf(stderr,"An Error Has Occurred\n"); return 1; }
+    if (argc >= 2 && strcmp(argv[1], "--convert") == 0) return convert_main(argc, argv);
+    if (argc < 2 || argc > 4) { fprintf(stderr,"An Error Has Occurred\n"); return 1; }
     if (!is_positive_integer(argv[1])) { fprintf(stderr,"Incorrect number of clusters!\n"); return 1; }
     k = (unsigned int)atoi(argv[1]);
 
-    if (argc == 3) {
+    if (argc >= 3) {
         if (!is_positive_integer(argv[2])) { fprintf(stderr,"Incorrect maximum iteration!\n"); return 1; }
         max_iters = (unsigned int)atoi(argv[2]);
     }
     else max_iters = MAX_ITER_DEFAULT;
+    if (argc == 4) input_path = argv[3];
 
-    points = read_points(&dim);
+    points = read_points(input_path);
     if (!points) { fprintf(stderr,"An Error Has Occurred\n"); return 1; }
 
-    if (k <= 1 || k >= points->length) { free_points_list(points); fprintf(stderr,"Incorrect number of clusters!\n"); return 1; }
-    if (max_iters <= 1 || max_iters >= 800) { free_points_list(points); fprintf(stderr,"Incorrect maximum iteration!\n"); return 1; }
-
-    matrix = points_to_matrix(points, dim);
-    if (!matrix) { free_points_list(points); fprintf(stderr,"An Error Has Occurred\n"); return 1; }
+    if (k <= 1 || k >= points->length) { free_point_arena(points); fprintf(stderr,"Incorrect number of clusters!\n"); return 1; }
+    if (max_iters <= 1 || max_iters >= 800) { free_point_arena(points); fprintf(stderr,"Incorrect maximum iteration!\n"); return 1; }
 
-    if (!kmeans(matrix, points->length, dim, k, max_iters)) {
-        free_matrix(matrix, points->length);
-        free_points_list(points);
+    if (!kmeans(points, k, max_iters, getenv("KMEANS_LABELS"))) {
+        free_point_arena(points);
         fprintf(stderr,"An Error Has Occurred\n");
         return 1;
     }
 
-    free_matrix(matrix, points->length);
-    free_points_list(points);
+    free_point_arena(points);
 
     return 0;
 }
\ No newline at end of file
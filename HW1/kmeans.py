@@ -112,10 +112,9 @@ def read_input():
     return datapoints
 
 def print_centroids(centroids):
-    """Print centroids formatted to 4 decimal places."""
-    for centroid in centroids:
-        formatted = ','.join(['%.4f' % val for val in centroid])
-        print(formatted)
+    """Print centroids formatted to 4 decimal places, in a single write."""
+    lines = [','.join(['%.4f' % val for val in centroid]) for centroid in centroids]
+    sys.stdout.write('\n'.join(lines) + '\n')
 
 def parse_int_strict(s):
     """Strictly parse integer - rejects 2.5, 2x, etc."""
@@ -1,16 +1,38 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define EPSILON 0.001
-#define MAX_LINE_LENGTH 10000
+#define MAX_THREADS 256
+#define MIN_CHUNK_BYTES (1 << 20)
+#define READ_BLOCK_SIZE (1 << 16)
+
+/* A newline-aligned slice of the input and the points parsed from it */
+typedef struct {
+    char *begin;
+    char *end;
+    double **points;
+    int count;
+    int capacity;
+    int dim;
+    int ok;
+} input_chunk;
 
 double euclidean_distance(double *point1, double *point2, int dimension);
+double squared_distance_bounded(double *point1, double *point2, int dimension, double limit);
 void assign_to_clusters(double **datapoints, int N, double **centroids, int K, int dimension, int *assignments);
 void update_centroids(double **datapoints, int N, double **centroids, int K, int dimension, int *assignments, int *cluster_sizes);
 int has_converged(double **old_centroids, double **new_centroids, int K, int dimension);
+double *parse_point(char *line, int dim, int *length);
+void *parse_chunk(void *arg);
+char *read_all_input(size_t *size);
+int thread_count(void);
 void read_input(double ***datapoints, int *N, int *dimension);
 void print_centroids(double **centroids, int K, int dimension);
 void free_memory(double **array, int rows);
@@ -26,17 +48,35 @@ double euclidean_distance(double *point1, double *point2, int dimension) {
     return sqrt(distance_squared);
 }
 
+/* Stops adding terms once the partial sum reaches limit, since the point is then no closer than the current best.
+   The sum is only checked every 8 terms to keep the branch out of the inner adds */
+double squared_distance_bounded(double *point1, double *point2, int dimension, double limit) {
+    double distance_squared = 0.0;
+    int i;
+    for (i = 0; i < dimension; i++) {
+        double diff = point1[i] - point2[i];
+        distance_squared += diff * diff;
+        if ((i & 7) == 7 && distance_squared >= limit) {
+            break;
+        }
+    }
+    return distance_squared;
+}
+
 void assign_to_clusters(double **datapoints, int N, double **centroids, int K, int dimension, int *assignments) {
     int i, k;
-    double min_distance, distance;
+    double min_squared, min_distance, squared;
     int closest_cluster;
     for (i = 0; i < N; i++) {
-        min_distance = euclidean_distance(datapoints[i], centroids[0], dimension);
+        min_squared = squared_distance_bounded(datapoints[i], centroids[0], dimension, HUGE_VAL);
+        min_distance = sqrt(min_squared);
         closest_cluster = 0;
         for (k = 1; k < K; k++) {
-            distance = euclidean_distance(datapoints[i], centroids[k], dimension);
-            if (distance < min_distance) {
-                min_distance = distance;
+            squared = squared_distance_bounded(datapoints[i], centroids[k], dimension, min_squared);
+            /* The root is only taken for a closer sum, so equal distances still keep the lower cluster */
+            if (squared < min_squared && sqrt(squared) < min_distance) {
+                min_squared = squared;
+                min_distance = sqrt(squared);
                 closest_cluster = k;
             }
         }
@@ -93,152 +133,272 @@ int parse_int_strict(const char *str) {
     return (int)value;
 }
 
-void read_input(double ***datapoints, int *N, int *dimension) {
-    char line[MAX_LINE_LENGTH];
-    char line_copy[MAX_LINE_LENGTH];
-    char temp[MAX_LINE_LENGTH];
-    int capacity, count, dim, i, line_dim, last_was_comma, temp_len;
-    double **data;
-    double *point;
+/*
+ * Parses one NUL-terminated line of comma separated values in place. With dim
+ * of -1 the point grows as values arrive; otherwise exactly dim values must be
+ * present. Returns NULL when the line is malformed.
+ */
+double *parse_point(char *line, int dim, int *length) {
+    char *ptr, *endptr;
+    int i, point_capacity;
+    double *point, *grown;
     double value;
-    char *ptr, *start, *end, *endptr;
-    size_t len;
-    
-    capacity = 100;
-    count = 0;
-    dim = -1;
     
-    data = (double **)malloc(capacity * sizeof(double *));
-    if (data == NULL) {
-        printf("An Error Has Occurred\n");
-        exit(1);
+    point_capacity = (dim == -1) ? 16 : dim;
+    point = (double *)malloc(point_capacity * sizeof(double));
+    if (point == NULL) {
+        return NULL;
     }
     
-    while (fgets(line, MAX_LINE_LENGTH, stdin) != NULL) {
-        if (line[0] == '\n' || line[0] == '\0') {
-            continue;
+    /* Tokenize in place: each value is parsed straight from the line into the point */
+    ptr = line;
+    i = 0;
+    while (1) {
+        value = strtod(ptr, &endptr);
+        if (endptr == ptr) {
+            break;
         }
-        
-        len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n') {
-            line[len - 1] = '\0';
+        ptr = endptr;
+        while (isspace((unsigned char)*ptr)) {
+            ptr++;
+        }
+        if (*ptr != ',' && *ptr != '\0') {
+            break;
         }
         
-        strcpy(line_copy, line);
-        
-        ptr = line_copy;
-        line_dim = 0;
-        last_was_comma = 1;
-        
-        while (*ptr != '\0') {
-            if (*ptr == ',') {
-                if (last_was_comma) {
-                    printf("An Error Has Occurred\n");
-                    free_memory(data, count);
-                    exit(1);
-                }
-                last_was_comma = 1;
-                line_dim++;
-            } else if (!isspace(*ptr)) {
-                last_was_comma = 0;
+        if (i == point_capacity) {
+            if (dim != -1) {
+                break;
             }
-            ptr++;
+            point_capacity *= 2;
+            grown = (double *)realloc(point, point_capacity * sizeof(double));
+            if (grown == NULL) {
+                break;
+            }
+            point = grown;
         }
+        point[i] = value;
+        i++;
         
-        if (last_was_comma && line_dim > 0) {
-            printf("An Error Has Occurred\n");
-            free_memory(data, count);
-            exit(1);
+        if (*ptr == '\0') {
+            ptr = NULL;
+            break;
         }
-        
-        line_dim++;
-        
-        if (dim == -1) {
-            dim = line_dim;
-        } else if (line_dim != dim) {
-            printf("An Error Has Occurred\n");
-            free_memory(data, count);
-            exit(1);
+        ptr++;
+    }
+    
+    /* ptr is only NULL when the whole line was consumed as comma separated values */
+    if (ptr != NULL || (dim != -1 && i != dim)) {
+        free(point);
+        return NULL;
+    }
+    *length = i;
+    return point;
+}
+
+/* Parses every line of a chunk; the chunk's first line sets its dimension */
+void *parse_chunk(void *arg) {
+    input_chunk *chunk;
+    char *line, *newline;
+    double **grown;
+    double *point;
+    int length;
+    
+    chunk = (input_chunk *)arg;
+    line = chunk->begin;
+    while (line < chunk->end) {
+        newline = memchr(line, '\n', chunk->end - line);
+        if (newline == NULL) {
+            newline = chunk->end;
+        }
+        *newline = '\0';
+        if (line[0] == '\0') {
+            line = newline + 1;
+            continue;
         }
         
-        point = (double *)malloc(dim * sizeof(double));
+        point = parse_point(line, chunk->dim, &length);
         if (point == NULL) {
-            printf("An Error Has Occurred\n");
-            free_memory(data, count);
-            exit(1);
+            return NULL;
+        }
+        if (chunk->dim == -1) {
+            chunk->dim = length;
         }
         
-        ptr = line;
-        i = 0;
-        
-        while (*ptr != '\0' && i < dim) {
-            start = ptr;
-            
-            while (*ptr != '\0' && *ptr != ',') {
-                ptr++;
-            }
-            
-            end = ptr;
-            
-            while (start < end && isspace(*start)) {
-                start++;
-            }
-            while (end > start && isspace(*(end - 1))) {
-                end--;
-            }
-            
-            if (start == end) {
-                printf("An Error Has Occurred\n");
-                free(point);
-                free_memory(data, count);
-                exit(1);
-            }
-            
-            temp_len = end - start;
-            
-            if (temp_len >= MAX_LINE_LENGTH) {
-                printf("An Error Has Occurred\n");
-                free(point);
-                free_memory(data, count);
-                exit(1);
-            }
-            
-            strncpy(temp, start, temp_len);
-            temp[temp_len] = '\0';
-            
-            value = strtod(temp, &endptr);
-            
-            if (*endptr != '\0') {
-                printf("An Error Has Occurred\n");
+        if (chunk->count >= chunk->capacity) {
+            chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 100;
+            grown = (double **)realloc(chunk->points, chunk->capacity * sizeof(double *));
+            if (grown == NULL) {
                 free(point);
-                free_memory(data, count);
-                exit(1);
-            }
-            
-            point[i] = value;
-            i++;
-            
-            if (*ptr == ',') {
-                ptr++;
+                return NULL;
             }
+            chunk->points = grown;
         }
-        
-        if (count >= capacity) {
+        chunk->points[chunk->count] = point;
+        chunk->count++;
+        line = newline + 1;
+    }
+    chunk->ok = 1;
+    return NULL;
+}
+
+/* Reads all of stdin into one buffer, with a spare byte past the end for a terminator */
+char *read_all_input(size_t *size) {
+    char *buffer, *grown;
+    size_t capacity, length, got;
+    
+    capacity = READ_BLOCK_SIZE;
+    length = 0;
+    buffer = (char *)malloc(capacity + 1);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    while ((got = fread(buffer + length, 1, capacity - length, stdin)) > 0) {
+        length += got;
+        if (length == capacity) {
             capacity *= 2;
-            data = (double **)realloc(data, capacity * sizeof(double *));
-            if (data == NULL) {
-                printf("An Error Has Occurred\n");
-                free(point);
-                exit(1);
+            grown = (char *)realloc(buffer, capacity + 1);
+            if (grown == NULL) {
+                free(buffer);
+                return NULL;
             }
+            buffer = grown;
         }
-        
-        data[count] = point;
-        count++;
+    }
+    if (ferror(stdin)) {
+        free(buffer);
+        return NULL;
+    }
+    *size = length;
+    return buffer;
+}
+
+/* KMEANS_THREADS overrides the number of online CPUs */
+int thread_count(void) {
+    const char *env;
+    char *endptr;
+    long n;
+    
+    n = 0;
+    env = getenv("KMEANS_THREADS");
+    if (env != NULL && *env != '\0') {
+        n = strtol(env, &endptr, 10);
+        if (*endptr != '\0') {
+            n = 0;
+        }
+    }
+    if (n < 1) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (n < 1) {
+        n = 1;
+    }
+    return n > MAX_THREADS ? MAX_THREADS : (int)n;
+}
+
+/*
+ * The input is split into newline-aligned chunks of at least MIN_CHUNK_BYTES,
+ * each parsed on its own thread, and the points are stitched back in input
+ * order so the first K points still seed the centroids. A malformed line in
+ * any chunk, or chunks disagreeing on the dimension, fail the whole read just
+ * as the line-by-line reader did.
+ */
+void read_input(double ***datapoints, int *N, int *dimension) {
+    input_chunk chunks[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    char *buffer, *begin, *cut, *limit;
+    size_t size;
+    int count, started, i, j, total, dim, ok;
+    double **data;
+    
+    buffer = read_all_input(&size);
+    if (buffer == NULL) {
+        printf("An Error Has Occurred\n");
+        exit(1);
+    }
+    
+    count = thread_count();
+    if ((size_t)count > size / MIN_CHUNK_BYTES) {
+        count = (int)(size / MIN_CHUNK_BYTES);
+    }
+    if (count < 1) {
+        count = 1;
+    }
+    
+    begin = buffer;
+    limit = buffer + size;
+    started = 0;
+    ok = 1;
+    for (i = 0; i < count; i++) {
+        cut = (i == count - 1) ? limit : buffer + size / count * (i + 1);
+        if (cut < begin) {
+            cut = begin;
+        }
+        if (cut < limit) {
+            cut = memchr(cut, '\n', limit - cut);
+            cut = (cut == NULL) ? limit : cut + 1;
+        }
+        chunks[i].begin = begin;
+        chunks[i].end = cut;
+        chunks[i].points = NULL;
+        chunks[i].count = 0;
+        chunks[i].capacity = 0;
+        chunks[i].dim = -1;
+        chunks[i].ok = 0;
+        begin = cut;
+    }
+    /* The calling thread takes the first chunk, and any chunk a thread could not be started for */
+    for (i = 1; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, parse_chunk, &chunks[i]) != 0) {
+            break;
+        }
+        started = i;
+    }
+    parse_chunk(&chunks[0]);
+    for (i = started + 1; i < count; i++) {
+        parse_chunk(&chunks[i]);
+    }
+    for (i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    total = 0;
+    dim = -1;
+    for (i = 0; i < count; i++) {
+        if (!chunks[i].ok) {
+            ok = 0;
+        }
+        if (chunks[i].count == 0) {
+            continue;
+        }
+        if (dim != -1 && chunks[i].dim != dim) {
+            ok = 0;
+        }
+        dim = chunks[i].dim;
+        total += chunks[i].count;
+    }
+    
+    data = ok ? (double **)malloc((total > 0 ? total : 1) * sizeof(double *)) : NULL;
+    if (data == NULL) {
+        printf("An Error Has Occurred\n");
+        for (i = 0; i < count; i++) {
+            free_memory(chunks[i].points, chunks[i].count);
+        }
+        free(buffer);
+        exit(1);
+    }
+    
+    total = 0;
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < chunks[i].count; j++) {
+            data[total++] = chunks[i].points[j];
+        }
+        free(chunks[i].points);
     }
     
+    free(buffer);
     *datapoints = data;
-    *N = count;
+    *N = total;
     *dimension = (dim == -1) ? 0 : dim;
 }
 
@@ -1,6 +1,9 @@
 import subprocess
 import os
 import sys
+import gzip
+import struct
+import tempfile
 
 # --- Configuration ---
 C_SOURCE = "kmeans.c"
@@ -38,16 +41,28 @@ def compile_c():
         sys.exit(1)
     log("✅ Compilation Successful.\n", Colors.OKGREEN)
 
-def run_program(command, input_str, test_name):
-    """Runs a command with input string and returns (return_code, stdout, stderr)"""
+def run_program(command, input_str, test_name, env=None, stdin_path=None):
+    """Runs a command with input string (or stdin redirected from stdin_path) and returns (return_code, stdout, stderr)"""
     try:
-        result = subprocess.run(
-            command,
-            input=input_str,
-            capture_output=True,
-            text=True,
-            timeout=TIMEOUT_SEC
-        )
+        if stdin_path:
+            with open(stdin_path, 'rb') as f:
+                result = subprocess.run(
+                    command,
+                    stdin=f,
+                    capture_output=True,
+                    text=True,
+                    timeout=TIMEOUT_SEC,
+                    env=dict(os.environ, **env) if env else None
+                )
+        else:
+            result = subprocess.run(
+                command,
+                input=input_str,
+                capture_output=True,
+                text=True,
+                timeout=TIMEOUT_SEC,
+                env=dict(os.environ, **env) if env else None
+            )
         return result.returncode, result.stdout, result.stderr
     except subprocess.TimeoutExpired:
         return -999, "", "TIMEOUT"
@@ -80,12 +95,12 @@ def analyze_result(lang, name, rc, out, err, expected_rc, expected_snippet):
 
     return True
 
-def run_test_case(name, input_data, args, expected_rc, expected_snippet=None, check_py=True):
+def run_test_case(name, input_data, args, expected_rc, expected_snippet=None, check_py=True, env=None, stdin_path=None):
     log(f"🧪 Test: {name}", Colors.HEADER)
     
     # 1. Test C
     c_cmd = [C_EXE] + args
-    c_rc, c_out, c_err = run_program(c_cmd, input_data, name)
+    c_rc, c_out, c_err = run_program(c_cmd, input_data, name, env, stdin_path)
     c_pass = analyze_result("C", name, c_rc, c_out, c_err, expected_rc, expected_snippet)
 
     # 2. Test Python (Optional)
@@ -130,6 +145,82 @@ def load_file(filename):
         print(f"⚠️  WARNING: '{filename}' not found. Test will be skipped or fail.")
         return None
 
+def write_gzip_copy(filename):
+    """Writes a gzip-compressed copy of filename to the temp directory and returns its path."""
+    path = os.path.join(tempfile.gettempdir(), os.path.basename(filename) + ".gz")
+    try:
+        with open(filename, 'rb') as src, gzip.open(path, 'wb') as dst:
+            dst.write(src.read())
+    except FileNotFoundError:
+        return filename + ".gz"
+    return path
+
+def temp_path(name):
+    return os.path.join(tempfile.gettempdir(), name)
+
+def write_binary_copy(filename, name, dtype="d", limit=None):
+    """Writes filename in the binary dataset format ('d' float64, 'f' float32), cut to limit bytes if given, and returns its path."""
+    path = temp_path(name)
+    try:
+        with open(filename, 'r') as f:
+            rows = [[float(x) for x in line.split(",")] for line in f if line.strip()]
+    except FileNotFoundError:
+        return path
+    header = struct.pack("<8sIIQI36x", b"KMEANSB1", 0x01020304, 1 if dtype == "d" else 2, len(rows), len(rows[0]))
+    payload = b"".join(struct.pack("<%d%s" % (len(r), dtype), *r) for r in rows)
+    data = header + payload
+    with open(path, 'wb') as f:
+        f.write(data[:limit] if limit else data)
+    return path
+
+
+def write_generated_input(name, n_points, dim, last_line=None):
+    """Writes n_points deterministic pseudo-random points to the temp directory, the last replaced by last_line if given, and returns its path."""
+    state = 12345
+    lines = []
+    for _ in range(n_points):
+        values = []
+        for _ in range(dim):
+            state = (state * 1103515245 + 12345) % 2147483648
+            values.append("%.4f" % (state / 2147483648.0 * 200.0 - 100.0))
+        lines.append(",".join(values))
+    if last_line is not None:
+        lines[-1] = last_line
+    path = temp_path(name)
+    with open(path, 'w') as f:
+        f.write("\n".join(lines) + "\n")
+    return path
+
+def write_grid_input(name, n_points, dim, levels):
+    """Writes n_points deterministic points with integer coordinates in [0, levels), so that many distances tie, and returns its path."""
+    state = 54321
+    lines = []
+    for _ in range(n_points):
+        values = []
+        for _ in range(dim):
+            state = (state * 1103515245 + 12345) % 2147483648
+            values.append(str((state >> 16) % levels))
+        lines.append(",".join(values))
+    path = temp_path(name)
+    with open(path, 'w') as f:
+        f.write("\n".join(lines) + "\n")
+    return path
+
+def python_output(path, args):
+    """Expected centroids for a generated input, from the Python reference implementation."""
+    with open(path, 'r') as f:
+        result = subprocess.run(["python3", PY_SCRIPT] + args, stdin=f, capture_output=True, text=True)
+    return result.stdout.strip()
+
+def check_labels(path, n_points, k):
+    """True when path holds one label in [0, k) per point."""
+    try:
+        with open(path, 'r') as f:
+            labels = f.read().split()
+    except FileNotFoundError:
+        return False
+    return len(labels) == n_points and all(x.isdigit() and int(x) < k for x in labels)
+
 
 # --- Main Execution ---
 if __name__ == "__main__":
@@ -150,6 +241,18 @@ if __name__ == "__main__":
     if out1: out1 = out1.strip()
     if out2: out2 = out2.strip()
     if out3: out3 = out3.strip()
+    gz3 = write_gzip_copy("input_3.txt")
+    kmb3 = temp_path("input_3.kmb")
+    truncated3 = write_binary_copy("input_3.txt", "input_3_truncated.kmb", limit=1000)
+    float3 = write_binary_copy("input_3.txt", "input_3_float32.kmb", dtype="f")
+    labels1 = temp_path("input_1.labels")
+    # over 2 MB, so the mapped input is split into chunks across threads
+    large = write_generated_input("large_4d.txt", 70000, 4)
+    large_out = python_output(large, ["5", "3"])
+    large_bad = write_generated_input("large_4d_malformed.txt", 70000, 4, "1.0,2.0,x,4.0")
+    large_dim = write_generated_input("large_4d_mismatch.txt", 70000, 4, "1.0,2.0,3.0")
+    grid = write_grid_input("grid_40d.txt", 400, 40, 3)
+    grid_out = python_output(grid, ["70", "300"])
 
     tests = [
         # --- Group A: Basic Argument Validation ---
@@ -387,6 +490,233 @@ if __name__ == "__main__":
             "input": in3,
             "rc": 0,
             "msg": out3
+        },
+
+        # --- Group I: C-only Extensions ---
+        {
+            "name": "Input Path Argument (K=15, iter=300, input_3.txt)",
+            "args": ["15", "300", "input_3.txt"],
+            "input": "",
+            "rc": 0,
+            "msg": out3,
+            "py": False
+        },
+        {
+            "name": "Chunked Parallel Parse (K=5, iter=3, 2.4 MB, 4 threads)",
+            "args": ["5", "3", large],
+            "input": "",
+            "rc": 0,
+            "msg": large_out,
+            "py": False,
+            "env": {"KMEANS_THREADS": "4"}
+        },
+        {
+            "name": "Integer Grid Ties Through The GEMM Path (K=70, 40-D)",
+            "args": ["70", "300", grid],
+            "input": "",
+            "rc": 0,
+            "msg": grid_out,
+            "py": False
+        },
+        {
+            "name": "Chunked Parallel Parse, Malformed Last Line",
+            "args": ["5", "3", large_bad],
+            "input": "",
+            "rc": 1,
+            "msg": MSG_ERR_GENERIC,
+            "py": False,
+            "env": {"KMEANS_THREADS": "4"}
+        },
+        {
+            "name": "Chunked Parallel Parse, Dimension Mismatch In Last Chunk",
+            "args": ["5", "3", large_dim],
+            "input": "",
+            "rc": 1,
+            "msg": MSG_ERR_GENERIC,
+            "py": False,
+            "env": {"KMEANS_THREADS": "4"}
+        },
+        {
+            "name": "Piped Input Path (K=3, iter=600, /dev/stdin)",
+            "args": ["3", "600", "/dev/stdin"],
+            "input": in1,
+            "rc": 0,
+            "msg": out1,
+            "py": False
+        },
+        {
+            "name": "Missing Input Path",
+            "args": ["2", "100", "no_such_input.txt"],
+            "input": "1,0\n2,0\n3,0",
+            "rc": 1,
+            "msg": MSG_ERR_GENERIC,
+            "py": False
+        },
+        {
+            "name": "Gzip Input Path (K=15, iter=300, input_3.txt.gz)",
+            "args": ["15", "300", gz3],
+            "input": "",
+            "rc": 0,
+            "msg": out3,
+            "py": False
+        },
+        {
+            "name": "Elkan Mode (K=15, iter=300, input_3.txt)",
+            "args": ["15", "300"],
+            "input": in3,
+            "rc": 0,
+            "msg": out3,
+            "py": False,
+            "env": {"KMEANS_ALGO": "elkan"}
+        },
+        {
+            "name": "Hamerly Mode (K=15, iter=300, input_3.txt)",
+            "args": ["15", "300"],
+            "input": in3,
+            "rc": 0,
+            "msg": out3,
+            "py": False,
+            "env": {"KMEANS_ALGO": "hamerly"}
+        },
+        {
+            "name": "Yinyang Mode (K=15, iter=300, input_3.txt)",
+            "args": ["15", "300"],
+            "input": in3,
+            "rc": 0,
+            "msg": out3,
+            "py": False,
+            "env": {"KMEANS_ALGO": "yinyang"}
+        },
+        {
+            "name": "Kd-tree Mode (K=15, iter=300, input_3.txt)",
+            "args": ["15", "300"],
+            "input": in3,
+            "rc": 0,
+            "msg": out3,
+            "py": False,
+            "env": {"KMEANS_ALGO": "kdtree"}
+        },
+        {
+            "name": "Worker Pool (K=15, iter=300, input_3.txt, 2 threads)",
+            "args": ["15", "300"],
+            "input": in3,
+            "rc": 0,
+            "msg": out3,
+            "py": False,
+            "env": {"KMEANS_THREADS": "2"}
+        },
+        {
+            "name": "Unknown KMEANS_ALGO",
+            "args": ["2", "100"],
+            "input": "1,0\n2,0\n3,0",
+            "rc": 1,
+            "msg": MSG_ERR_GENERIC,
+            "py": False,
+            "env": {"KMEANS_ALGO": "bogus"}
+        },
+        {
+            "name": "Float32 Precision (K=15, iter=300, input_3.txt)",
+            "args": ["15", "300"],
+            "input": in3,
+            "rc": 0,
+            "msg": out3,
+            "py": False,
+            "env": {"KMEANS_PRECISION": "float32"}
+        },
+        {
+            "name": "Unknown KMEANS_PRECISION",
+            "args": ["2", "100"],
+            "input": "1,0\n2,0\n3,0",
+            "rc": 1,
+            "msg": MSG_ERR_GENERIC,
+            "py": False,
+            "env": {"KMEANS_PRECISION": "bogus"}
+        },
+        {
+            "name": "KMEANS_ALGO With Float32 Precision",
+            "args": ["15", "300"],
+            "input": in3,
+            "rc": 1,
+            "msg": MSG_ERR_GENERIC,
+            "py": False,
+            "env": {"KMEANS_PRECISION": "float32", "KMEANS_ALGO": "elkan"}
+        },
+        {
+            "name": "Float32 Binary Input (K=15, iter=300, input_3.kmb)",
+            "args": ["15", "300", float3],
+            "input": "",
+            "rc": 0,
+            "msg": out3,
+            "py": False
+        },
+        {
+            "name": "Labels Output (K=3, iter=600, input_1.txt)",
+            "args": ["3", "600"],
+            "input": in1,
+            "rc": 0,
+            "msg": out1,
+            "py": False,
+            "env": {"KMEANS_LABELS": labels1},
+            "check": lambda: check_labels(labels1, 800, 3),
+            "check_msg": "Labels file should hold 800 labels in [0, 3)."
+        },
+        {
+            "name": "Unwritable Labels Path",
+            "args": ["3", "600"],
+            "input": in1,
+            "rc": 1,
+            "msg": MSG_ERR_GENERIC,
+            "py": False,
+            "env": {"KMEANS_LABELS": os.path.join(tempfile.gettempdir(), "no_such_dir", "labels.txt")}
+        },
+        {
+            "name": "Convert To Binary (input_3.txt)",
+            "args": ["--convert", kmb3, "input_3.txt"],
+            "input": "",
+            "rc": 0,
+            "msg": None,
+            "py": False
+        },
+        {
+            "name": "Binary Input Path (K=15, iter=300, input_3.kmb)",
+            "args": ["15", "300", kmb3],
+            "input": "",
+            "rc": 0,
+            "msg": out3,
+            "py": False
+        },
+        {
+            "name": "Binary Input On Stdin (K=15, iter=300, input_3.kmb)",
+            "args": ["15", "300"],
+            "input": "",
+            "rc": 0,
+            "msg": out3,
+            "py": False,
+            "stdin": kmb3
+        },
+        {
+            "name": "Truncated Binary Input",
+            "args": ["15", "300", truncated3],
+            "input": "",
+            "rc": 1,
+            "msg": MSG_ERR_GENERIC,
+            "py": False
+        },
+        {
+            "name": "Convert Without Output Path",
+            "args": ["--convert"],
+            "input": "",
+            "rc": 1,
+            "msg": MSG_ERR_GENERIC,
+            "py": False
+        },
+        {
+            "name": "Convert With Extra Argument",
+            "args": ["--convert", kmb3, "input_3.txt", "extra"],
+            "input": "",
+            "rc": 1,
+            "msg": MSG_ERR_GENERIC,
+            "py": False
         }
     ]
 
@@ -400,8 +730,13 @@ if __name__ == "__main__":
             t["args"], 
             t["rc"], 
             t["msg"],
-            check_py=True # Set to False if you only want to check C for now
+            check_py=t.get("py", True), # Set to False if you only want to check C for now
+            env=t.get("env"),
+            stdin_path=t.get("stdin")
         )
+        if success and "check" in t and not t["check"]():
+            log(f"   [C] ❌ FAIL: {t['check_msg']}", Colors.FAIL)
+            success = False
         if success:
             passed_tests += 1
 
@@ -1,33 +1,25 @@
 #define _GNU_SOURCE
 #define EPSILON 0.001
 #define MAX_ITER_DEFAULT 400
+#define ALIGNMENT 64
+#define ARENA_INITIAL_CAPACITY 4096
+#define FAST_PATH_DIGITS 15
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 /* ===================== DATA STRUCTURES ===================== */
 
-typedef struct point_coordinates_cell {
-    double data;
-    struct point_coordinates_cell *next;
-} point_coordinates_cell;
-
-typedef struct point_coordinates_list {
-    point_coordinates_cell *head;
-    point_coordinates_cell *tail;
-} point_coordinates_list;
-
-typedef struct points_cell {
-    point_coordinates_list *point;
-    struct points_cell *next;
-} points_cell;
-
-typedef struct points_list {
-    points_cell *head;
-    points_cell *tail;
+/* All points live in one row-major block: point i is data[i*dim .. i*dim+dim-1]. */
+typedef struct point_arena {
+    double *data;
+    size_t capacity;
+    size_t used;
     unsigned int length;
-} points_list;
+    unsigned int dim;
+} point_arena;
 
 typedef struct {
     double *coords;
@@ -39,107 +31,151 @@ int is_whitespace(char c) {
     return (c == ' ' || c == '\t' || c == '\n' || c == '\r');
 }
 
-/* ===================== LINKED LIST HELPERS ===================== */
+/* ===================== POINT ARENA ===================== */
 
-point_coordinates_list *create_point_coordinates_list() {
-    point_coordinates_list *list = malloc(sizeof(point_coordinates_list));
-    if (!list) return NULL;
-    list->head = list->tail = NULL;
-    return list;
+double *allocate_aligned_doubles(size_t count) {
+    void *block;
+    if (posix_memalign(&block, ALIGNMENT, count * sizeof(double)) != 0) return NULL;
+    return block;
 }
 
-int add_coordinate(point_coordinates_list *list, double value) {
-    point_coordinates_cell *cell = malloc(sizeof(point_coordinates_cell));
-    if (!cell) return 0;
-    cell->data = value;
-    cell->next = NULL;
-    if (!list->head) list->head = list->tail = cell;
-    else { list->tail->next = cell; list->tail = cell; }
-    return 1;
+point_arena *create_point_arena() {
+    point_arena *arena = malloc(sizeof(point_arena));
+    if (!arena) return NULL;
+    arena->data = allocate_aligned_doubles(ARENA_INITIAL_CAPACITY);
+    if (!arena->data) { 
+        free(arena); 
+        return NULL; 
+    }
+    arena->capacity = ARENA_INITIAL_CAPACITY;
+    arena->used = 0;
+    arena->length = 0;
+    arena->dim = 0;
+    return arena;
 }
 
-points_cell *create_points_cell(point_coordinates_list *point) {
-    points_cell *cell = malloc(sizeof(points_cell));
-    if (!cell) return NULL;
-    cell->point = point;
-    cell->next = NULL;
-    return cell;
+int grow_point_arena(point_arena *arena) {
+    size_t new_capacity = arena->capacity * 2;
+    double *data = allocate_aligned_doubles(new_capacity);
+    if (!data) return 0;
+    memcpy(data, arena->data, arena->used * sizeof(double));
+    free(arena->data);
+    arena->data = data;
+    arena->capacity = new_capacity;
+    return 1;
 }
 
-int add_point(points_list *plist, point_coordinates_list *point) {
-    points_cell *cell = create_points_cell(point);
-    if (!cell) return 0;
-    if (!plist->head) plist->head = plist->tail = cell;
-    else { plist->tail->next = cell; plist->tail = cell; }
-    plist->length++;
+int add_coordinate(point_arena *arena, double value) {
+    if (arena->used == arena->capacity && !grow_point_arena(arena)) return 0;
+    arena->data[arena->used++] = value;
     return 1;
 }
 
-points_list *create_points_list() {
-    points_list *plist = malloc(sizeof(points_list));
-    if (!plist) return NULL;
-    plist->head = plist->tail = NULL;
-    plist->length = 0;
-    return plist;
+/* Closes the row started at row_start; the first row fixes the dimension of the arena. */
+int commit_point(point_arena *arena, size_t row_start) {
+    unsigned int dim_count = (unsigned int)(arena->used - row_start);
+    if (arena->length == 0) {
+        arena->dim = dim_count;
+    }
+    else if (dim_count != arena->dim) { 
+        arena->used = row_start; 
+        return 0; 
+    }
+    arena->length++;
+    return 1;
 }
 
-void free_point_coordinates_list(point_coordinates_list *list) {
-    point_coordinates_cell *c, *next;
-    if (!list) return;
-    c = list->head;
-    while (c) {
-        next = c->next;
-        free(c);
-        c = next;
-    }
-    free(list);
+void free_point_arena(point_arena *arena) {
+    if (!arena) return;
+    free(arena->data);
+    free(arena);
 }
 
-void free_points_list(points_list *plist) {
-    points_cell *p, *next_p;
-    if (!plist) return;
-    p = plist->head;
-    while (p) {
-        free_point_coordinates_list(p->point);
-        next_p = p->next;
-        free(p);
-        p = next_p;
+/* ===================== NUMBER PARSING ===================== */
+
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * Locale-free replacement for sscanf("%lf"). A plain decimal with at most
+ * FAST_PATH_DIGITS significant digits and a power of ten up to 1e22 is one
+ * exact integer scaled by one exact power of ten, so a single multiply or
+ * divide rounds it exactly like strtod (Clinger's fast path). Anything else
+ * (long mantissas, large exponents, hex, inf, nan, leading whitespace) is
+ * handed to strtod itself. Returns the end of the number, or NULL if none.
+ */
+const char *parse_double(const char *str, double *value) {
+    const char *p = str, *digits_start, *exp_start;
+    double mantissa = 0, result;
+    int negative = 0, exact = 1, digits = 0, significant = 0, exponent = 0, exp_value = 0, exp_negative = 0;
+    char *end;
+
+    if (*p == '-' || *p == '+') { negative = (*p == '-'); p++; }
+    digits_start = p;
+    for (; *p >= '0' && *p <= '9'; p++, digits++) {
+        if (mantissa == 0 && *p == '0') continue;
+        if (significant == FAST_PATH_DIGITS) { exact = 0; continue; }
+        mantissa = mantissa * 10 + (*p - '0');
+        significant++;
     }
-    free(plist);
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++, digits++) {
+            if (mantissa == 0 && *p == '0') { exponent--; continue; }
+            if (significant == FAST_PATH_DIGITS) { exact = 0; continue; }
+            mantissa = mantissa * 10 + (*p - '0');
+            significant++;
+            exponent--;
+        }
+    }
+    if (digits == 0) exact = 0;
+    if (p == digits_start + 1 && *digits_start == '0' && (*p == 'x' || *p == 'X')) exact = 0;
+    if (exact && (*p == 'e' || *p == 'E')) {
+        exp_start = p++;
+        if (*p == '-' || *p == '+') { exp_negative = (*p == '-'); p++; }
+        if (*p < '0' || *p > '9') p = exp_start;
+        for (; *p >= '0' && *p <= '9'; p++) if (exp_value < 10000) exp_value = exp_value * 10 + (*p - '0');
+        exponent += exp_negative ? -exp_value : exp_value;
+    }
+    if (exact && exponent >= -22 && exponent <= 22) {
+        result = exponent < 0 ? mantissa / powers_of_ten[-exponent] : mantissa * powers_of_ten[exponent];
+        *value = negative ? -result : result;
+        return p;
+    }
+    *value = strtod(str, &end);
+    return end == str ? NULL : end;
 }
 
 /* ===================== INPUT READING ===================== */
 
-point_coordinates_list *parse_line(const char *line, unsigned int expected_dim) {
-    const char *ptr = line;
-    unsigned int dim_count = 0;
-    int n;
+int parse_line(const char *line, point_arena *arena) {
+    const char *ptr = line, *end;
+    size_t row_start = arena->used;
     double value;
-    point_coordinates_list *coords = create_point_coordinates_list();
-    if (!coords) return NULL;
     
     /* Skip leading whitespace */
     while (*ptr && is_whitespace(*ptr)) ptr++;
     
     while (*ptr) {
         /* Try to parse a double */
-        if (sscanf(ptr, "%lf%n", &value, &n) != 1) { 
-            free_point_coordinates_list(coords); 
-            return NULL; 
+        end = parse_double(ptr, &value);
+        if (!end) { 
+            arena->used = row_start; 
+            return 0; 
         }
         
         /* Check for garbage after number (like "2.5x" or "2a") */
-        if (ptr[n] != ',' && ptr[n] != '\0' && !is_whitespace(ptr[n])) {
-            free_point_coordinates_list(coords);
-            return NULL;
+        if (*end != ',' && *end != '\0' && !is_whitespace(*end)) {
+            arena->used = row_start;
+            return 0;
         }
         
-        if (!add_coordinate(coords, value)) { 
-            free_point_coordinates_list(coords); 
-            return NULL; 
+        if (!add_coordinate(arena, value)) { 
+            arena->used = row_start; 
+            return 0; 
         }
-        ptr += n;
-        dim_count++;
+        ptr = end;
         
         /* Skip trailing whitespace after number */
         while (*ptr && is_whitespace(*ptr)) ptr++;
@@ -150,36 +186,29 @@ point_coordinates_list *parse_line(const char *line, unsigned int expected_dim)
             while (*ptr && is_whitespace(*ptr)) ptr++;
             /* Check for double comma or trailing comma */
             if (*ptr == ',' || *ptr == '\0') {
-                free_point_coordinates_list(coords);
-                return NULL;
+                arena->used = row_start;
+                return 0;
             }
         }
         else if (*ptr != '\0') { 
-            free_point_coordinates_list(coords); 
-            return NULL; 
+            arena->used = row_start; 
+            return 0; 
         }
     }
     
-    if (expected_dim != 0 && dim_count != expected_dim) { 
-        free_point_coordinates_list(coords); 
-        return NULL; 
-    }
-    return coords;
+    return commit_point(arena, row_start);
 }
 
-points_list *read_points(unsigned int *dim) {
-    points_list *plist;
+point_arena *read_points() {
+    point_arena *arena;
     char *line = NULL;
     size_t len = 0;
     ssize_t nread;
-    *dim = 0;
 
-    plist = create_points_list();
-    if (!plist) return NULL;
+    arena = create_point_arena();
+    if (!arena) return NULL;
 
     while ((nread = getline(&line, &len, stdin)) != -1) {
-        point_coordinates_list *coords;
-        
         /* Strip trailing newline/carriage return */
         while (nread > 0 && (line[nread - 1] == '\n' || line[nread - 1] == '\r')) {
             line[--nread] = '\0';
@@ -190,76 +219,23 @@ points_list *read_points(unsigned int *dim) {
             continue;
         }
         
-        coords = parse_line(line, *dim);
-        if (!coords) { 
-            free(line);
-            free_points_list(plist); 
-            return NULL; 
-        }
-        
-        if (plist->length == 0) {
-            point_coordinates_cell *c = coords->head;
-            unsigned int count = 0;
-            while (c) { count++; c = c->next; }
-            *dim = count;
-        }
-        
-        if (!add_point(plist, coords)) { 
-            free_point_coordinates_list(coords); 
-            free_points_list(plist); 
+        if (!parse_line(line, arena)) { 
             free(line);
+            free_point_arena(arena); 
             return NULL; 
         }
     }
     free(line);
-    if (plist->length == 0) { 
-        free_points_list(plist); 
+    if (arena->length == 0) { 
+        free_point_arena(arena); 
         return NULL; 
     }
-    return plist;
-}
-
-/* ===================== MATRIX CONVERSION ===================== */
-
-double **points_to_matrix(points_list *plist, unsigned int dim) {
-    double **matrix;
-    points_cell *p;
-    unsigned int i, j;
-
-    matrix = malloc(plist->length * sizeof(double*));
-    if (!matrix) return NULL;
-    p = plist->head;
-    i = 0;
-    while (p) {
-        point_coordinates_cell *c;
-        matrix[i] = malloc(dim * sizeof(double));
-        if (!matrix[i]) { 
-            for (j = 0; j < i; j++) free(matrix[j]); 
-            free(matrix); 
-            return NULL; 
-        }
-        c = p->point->head;
-        j = 0;
-        while (c) {
-            matrix[i][j++] = c->data;
-            c = c->next;
-        }
-        p = p->next;
-        i++;
-    }
-    return matrix;
-}
-
-void free_matrix(double **matrix, unsigned int n) {
-    unsigned int i;
-    if (!matrix) return;
-    for (i = 0; i < n; i++) free(matrix[i]);
-    free(matrix);
+    return arena;
 }
 
 /* ===================== K-MEANS ===================== */
 
-double distance(double *a, double *b, unsigned int dim) {
+double distance(const double *a, const double *b, unsigned int dim) {
     unsigned int i;
     double sum = 0, diff;
     for (i = 0; i < dim; i++) { 
@@ -299,14 +275,14 @@ void copy_centroids(centroid *dest, centroid *src, unsigned int k, unsigned int
             dest[i].coords[j] = src[i].coords[j];
 }
 
-void assign_labels(double **points, centroid *centroids, unsigned int n, unsigned int k, unsigned int dim, unsigned int *labels) {
+void assign_labels(const double *points, centroid *centroids, unsigned int n, unsigned int k, unsigned int dim, unsigned int *labels) {
     unsigned int i, j, best;
     double best_dist, d;
     for (i = 0; i < n; i++) {
         best = 0;
-        best_dist = distance(points[i], centroids[0].coords, dim);
+        best_dist = distance(points + (size_t)i * dim, centroids[0].coords, dim);
         for (j = 1; j < k; j++) {
-            d = distance(points[i], centroids[j].coords, dim);
+            d = distance(points + (size_t)i * dim, centroids[j].coords, dim);
             if (d < best_dist) { 
                 best_dist = d; 
                 best = j; 
@@ -316,23 +292,22 @@ void assign_labels(double **points, centroid *centroids, unsigned int n, unsigne
     }
 }
 
-void update_centroids(double **points, centroid *centroids, unsigned int *labels, unsigned int n, unsigned int k, unsigned int dim) {
-    unsigned int i, j, d, count;
+/* One pass over the points into the caller's k x dim sums and k counts, which are reused every iteration. */
+void update_centroids(const double *points, centroid *centroids, unsigned int *labels, unsigned int n, unsigned int k, unsigned int dim,
+                      double *sums, unsigned int *counts) {
+    unsigned int i, j, d;
     double *sum;
+    memset(sums, 0, (size_t)k * dim * sizeof(double));
+    memset(counts, 0, k * sizeof(unsigned int));
+    for (i = 0; i < n; i++) {
+        sum = sums + (size_t)labels[i] * dim;
+        for (d = 0; d < dim; d++) sum[d] += points[(size_t)i * dim + d];
+        counts[labels[i]]++;
+    }
     for (j = 0; j < k; j++) {
-        sum = calloc(dim, sizeof(double));
-        if (!sum) return;
-        count = 0;
-        for (i = 0; i < n; i++) {
-            if (labels[i] == j) {
-                for (d = 0; d < dim; d++) sum[d] += points[i][d];
-                count++;
-            }
-        }
-        if (count > 0) 
+        if (counts[j] > 0) 
             for (d = 0; d < dim; d++) 
-                centroids[j].coords[d] = sum[d] / count;
-        free(sum);
+                centroids[j].coords[d] = sums[(size_t)j * dim + d] / counts[j];
     }
 }
 
@@ -357,17 +332,22 @@ void print_centroids(centroid *centroids, unsigned int k, unsigned int dim) {
     }
 }
 
-int kmeans(double **points, unsigned int n, unsigned int dim, unsigned int k, unsigned int max_iters) {
+int kmeans(const double *points, unsigned int n, unsigned int dim, unsigned int k, unsigned int max_iters) {
     unsigned int i, iter, j;
-    unsigned int *labels;
+    unsigned int *labels, *counts;
+    double *sums;
     centroid *centroids, *old_centroids;
 
     labels = malloc(n * sizeof(unsigned int));
     if (!labels) return 0;
     centroids = allocate_centroids(k, dim);
     old_centroids = allocate_centroids(k, dim);
-    if (!centroids || !old_centroids) { 
+    sums = malloc((size_t)k * dim * sizeof(double));
+    counts = malloc(k * sizeof(unsigned int));
+    if (!centroids || !old_centroids || !sums || !counts) { 
         free(labels); 
+        free(sums); 
+        free(counts); 
         free_centroids(centroids, k); 
         free_centroids(old_centroids, k); 
         return 0; 
@@ -376,17 +356,19 @@ int kmeans(double **points, unsigned int n, unsigned int dim, unsigned int k, un
     /* Initialize centroids as first k datapoints */
     for (i = 0; i < k; i++)
         for (j = 0; j < dim; j++)
-            centroids[i].coords[j] = points[i][j];
+            centroids[i].coords[j] = points[(size_t)i * dim + j];
 
     for (iter = 0; iter < max_iters; iter++) {
         assign_labels(points, centroids, n, k, dim, labels);
         copy_centroids(old_centroids, centroids, k, dim);
-        update_centroids(points, centroids, labels, n, k, dim);
+        update_centroids(points, centroids, labels, n, k, dim, sums, counts);
         if (max_centroid_change(centroids, old_centroids, k, dim) < EPSILON) break;
     }
 
     print_centroids(centroids, k, dim);
     free(labels);
+    free(sums);
+    free(counts);
     free_centroids(centroids, k);
     free_centroids(old_centroids, k);
     return 1;
@@ -414,9 +396,8 @@ int is_positive_integer(const char *str) {
 }
 
 int main(int argc, char *argv[]) {
-    points_list *points = NULL;
-    double **matrix = NULL;
-    unsigned int dim, k, max_iters;
+    point_arena *points = NULL;
+    unsigned int k, max_iters;
     long temp;
     char *endptr;
 
@@ -455,7 +436,7 @@ int main(int argc, char *argv[]) {
     }
 
     /* Read points from stdin */
-    points = read_points(&dim);
+    points = read_points();
     if (!points) { 
         fprintf(stderr, "An Error Has Occurred\n"); 
         return 1; 
@@ -463,34 +444,25 @@ int main(int argc, char *argv[]) {
 
     /* Validate K against N */
     if (k <= 1 || k >= points->length) { 
-        free_points_list(points); 
+        free_point_arena(points); 
         fprintf(stderr, "Incorrect number of clusters!\n"); 
         return 1; 
     }
     
     /* Validate iter: 1 < iter < 800 */
     if (max_iters <= 1 || max_iters >= 800) { 
-        free_points_list(points); 
+        free_point_arena(points); 
         fprintf(stderr, "Incorrect maximum iteration!\n"); 
         return 1; 
     }
 
-    matrix = points_to_matrix(points, dim);
-    if (!matrix) { 
-        free_points_list(points); 
-        fprintf(stderr, "An Error Has Occurred\n"); 
-        return 1; 
-    }
-
-    if (!kmeans(matrix, points->length, dim, k, max_iters)) {
-        free_matrix(matrix, points->length);
-        free_points_list(points);
+    if (!kmeans(points->data, points->length, points->dim, k, max_iters)) {
+        free_point_arena(points);
         fprintf(stderr, "An Error Has Occurred\n");
         return 1;
     }
 
-    free_matrix(matrix, points->length);
-    free_points_list(points);
+    free_point_arena(points);
 
     return 0;
 }
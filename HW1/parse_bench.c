@@ -0,0 +1,117 @@
+/*
+ * Microbenchmark for parse_double against the old sscanf("%lf%n") path.
+ *
+ * Build: gcc -ansi -Wall -Wextra -Werror -pedantic-errors -O2 parse_bench.c -o parse_bench -lm
+ * Usage: ./parse_bench [sample_file] [megabytes]   (defaults: input_3.txt, 1024)
+ *
+ * The sample file is repeated in memory until the requested size is reached
+ * and split into NUL-terminated lines, as read_points hands them to
+ * parse_line. Every comma separated token is then parsed by both paths; the
+ * results must be bit-identical.
+ */
+#define main kmeans_main
+#include "kmeans.c"
+#undef main
+
+#include <time.h>
+
+char *load_scaled_sample(const char *path, size_t target, size_t *out_len) {
+    FILE *f;
+    char *sample, *buf, *p;
+    long sample_len;
+    size_t len = 0;
+
+    f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    sample_len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    sample = malloc(sample_len);
+    if (!sample || sample_len <= 0 || fread(sample, 1, sample_len, f) != (size_t)sample_len) { fclose(f); free(sample); return NULL; }
+    fclose(f);
+
+    buf = malloc(target + sample_len + 1);
+    if (!buf) { free(sample); return NULL; }
+    while (len < target) { memcpy(buf + len, sample, sample_len); len += sample_len; }
+    buf[len] = '\0';
+    free(sample);
+    for (p = buf; p < buf + len; p++) if (*p == '\n') *p = '\0';
+    *out_len = len;
+    return buf;
+}
+
+double time_sscanf(const char *buf, size_t len, double *checksum, unsigned long *tokens) {
+    const char *p = buf, *limit = buf + len;
+    double value, sum = 0;
+    unsigned long count = 0;
+    int n;
+    clock_t start = clock();
+    while (p < limit) {
+        if (sscanf(p, "%lf%n", &value, &n) != 1) break;
+        sum += value;
+        count++;
+        p += n + 1;
+    }
+    *checksum = sum;
+    *tokens = count;
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+double time_parse_double(const char *buf, size_t len, double *checksum, unsigned long *tokens) {
+    const char *p = buf, *end, *limit = buf + len;
+    double value, sum = 0;
+    unsigned long count = 0;
+    clock_t start = clock();
+    while (p < limit) {
+        end = parse_double(p, &value);
+        if (!end) break;
+        sum += value;
+        count++;
+        p = end + 1;
+    }
+    *checksum = sum;
+    *tokens = count;
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+unsigned long count_mismatches(const char *buf, size_t len) {
+    const char *p = buf, *end, *limit = buf + len;
+    char *strtod_end;
+    double a, b;
+    unsigned long mismatches = 0;
+    while (p < limit) {
+        a = strtod(p, &strtod_end);
+        end = parse_double(p, &b);
+        if (!end || end != strtod_end || memcmp(&a, &b, sizeof(double)) != 0) mismatches++;
+        if (!end) break;
+        p = end + 1;
+    }
+    return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "input_3.txt";
+    size_t megabytes = argc > 2 ? (size_t)atol(argv[2]) : 1024;
+    size_t len;
+    unsigned long scanf_tokens, fast_tokens;
+    double scanf_sum, fast_sum, scanf_secs, fast_secs;
+    char *buf;
+
+    buf = load_scaled_sample(path, megabytes * 1024 * 1024, &len);
+    if (!buf) { fprintf(stderr, "An Error Has Occurred\n"); return 1; }
+
+    scanf_secs = time_sscanf(buf, len, &scanf_sum, &scanf_tokens);
+    fast_secs = time_parse_double(buf, len, &fast_sum, &fast_tokens);
+
+    printf("input: %lu MB, %lu tokens\n", (unsigned long)(len >> 20), fast_tokens);
+    printf("sscanf:       %8.3f s  %8.1f MB/s\n", scanf_secs, len / 1048576.0 / scanf_secs);
+    printf("parse_double: %8.3f s  %8.1f MB/s\n", fast_secs, len / 1048576.0 / fast_secs);
+    printf("speedup:      %8.2fx\n", scanf_secs / fast_secs);
+    printf("tokens match: %s, checksums match: %s, strtod mismatches: %lu\n",
+           scanf_tokens == fast_tokens ? "yes" : "no",
+           memcmp(&scanf_sum, &fast_sum, sizeof(double)) == 0 ? "yes" : "no",
+           count_mismatches(buf, len));
+
+    free(buf);
+    return 0;
+}